@@ -0,0 +1,366 @@
+#include <kdtree.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Timings of the query strategies of kdtree, with the nodes visited per
+// query where the query counts them.
+//
+//   kdtree_bench [entries] [queries]
+
+using namespace spatial_index;
+
+namespace {
+
+typedef boost::geometry::model::d2::point_xy<double> point;
+typedef kdtree<int, point> tree_type;
+
+class stopwatch {
+    public:
+        stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+        double milliseconds() const {
+            return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - m_start).count();
+        }
+
+    private:
+        std::chrono::steady_clock::time_point m_start;
+};
+
+// Hardware event count of the calling thread through perf_event_open, or
+// -1 where the kernel or the machine does not offer it.
+class perf_counter {
+    public:
+        enum event {
+            cache_misses,
+            tlb_misses
+        };
+
+        explicit perf_counter(event e) : m_fd(-1) {
+#if defined(__linux__)
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            if (e == cache_misses) {
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            } else {
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            }
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            m_fd = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+            (void)e;
+#endif
+        }
+
+        ~perf_counter() {
+#if defined(__linux__)
+            if (m_fd >= 0) {
+                close(m_fd);
+            }
+#endif
+        }
+
+        void start() {
+#if defined(__linux__)
+            if (m_fd >= 0) {
+                ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        long long stop() {
+            long long count = -1;
+#if defined(__linux__)
+            if (m_fd >= 0) {
+                ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(m_fd, &count, sizeof(count)) != sizeof(count)) {
+                    count = -1;
+                }
+            }
+#endif
+            return count;
+        }
+
+    private:
+        int m_fd;
+};
+
+// Keeps the results alive.
+double checksum = 0;
+
+struct workload {
+    std::vector<point> entries;
+    std::vector<int> data;
+    std::vector<point> queries;
+};
+
+// Uniform in a 1000 x 1000 square.
+void uniform(size_t entries, size_t queries, workload &w) {
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> coordinate(0, 1000);
+    w.entries.resize(entries);
+    for (size_t i = 0; i < entries; i++) {
+        w.entries[i] = point(coordinate(random), coordinate(random));
+    }
+    w.data.assign(entries, 0);
+    w.queries.resize(queries);
+    for (size_t i = 0; i < queries; i++) {
+        w.queries[i] = point(coordinate(random), coordinate(random));
+    }
+}
+
+// 100 Gaussian clusters of unit deviation in the same square, queries
+// drawn the same way.
+void clustered(size_t entries, size_t queries, workload &w) {
+    std::mt19937 random(2);
+    std::uniform_real_distribution<double> coordinate(0, 1000);
+    std::normal_distribution<double> offset(0, 1);
+    std::vector<point> centers(100);
+    for (size_t i = 0; i < centers.size(); i++) {
+        centers[i] = point(coordinate(random), coordinate(random));
+    }
+    w.entries.resize(entries + queries);
+    for (size_t i = 0; i < w.entries.size(); i++) {
+        const point &center = centers[random() % centers.size()];
+        w.entries[i] = point(center.x() + offset(random), center.y() + offset(random));
+    }
+    w.queries.assign(w.entries.begin() + entries, w.entries.end());
+    w.entries.resize(entries);
+    w.data.assign(entries, 0);
+}
+
+void fill(tree_type &tree, const workload &w) {
+    for (size_t i = 0; i < w.entries.size(); i++) {
+        tree.add(&w.entries[i], &w.data[i]);
+    }
+}
+
+// 0 visited for the queries that do not count them.
+void report(const char *name, double milliseconds, size_t queries, size_t visited) {
+    if (visited) {
+        std::printf("  %-32s %9.1f ms %9.1f nodes/query\n", name, milliseconds,
+                    double(visited) / queries);
+    } else {
+        std::printf("  %-32s %9.1f ms %9s\n", name, milliseconds, "-");
+    }
+}
+
+// Recursive depth-first, explicit stack depth-first, best-first and
+// batched lockstep kNN over the same tree.
+void traversals(const workload &w, size_t k) {
+
+    std::printf("traversals, k = %zu\n", k);
+
+    tree_type tree;
+    fill(tree, w);
+    tree.build();
+
+    tree_type::query_context context;
+    std::vector<tree_type::query_result> result;
+    const size_t n = w.queries.size();
+
+    if (k == 1) {
+        tree_type::query_result nearest;
+        stopwatch recursive;
+        for (size_t i = 0; i < n; i++) {
+            tree.nearest_recursive(w.queries[i], nearest, context);
+            checksum += nearest.comparable_distance;
+        }
+        report("nearest_recursive", recursive.milliseconds(), n, 0);
+
+        context.reset_statistics();
+        stopwatch best_first;
+        for (size_t i = 0; i < n; i++) {
+            tree.nearest_iterative(w.queries[i], nearest, context);
+            checksum += nearest.comparable_distance;
+        }
+        report("nearest_iterative (best-first)", best_first.milliseconds(), n,
+               context.nodes_visited());
+    }
+
+    stopwatch recursive;
+    for (size_t i = 0; i < n; i++) {
+        tree.knearest(w.queries[i], k, result, context);
+        checksum += result.back().comparable_distance;
+    }
+    report("knearest (recursive)", recursive.milliseconds(), n, 0);
+
+    context.reset_statistics();
+    stopwatch explicit_stack;
+    for (size_t i = 0; i < n; i++) {
+        tree.knearest_iterative(w.queries[i], k, result, context);
+        checksum += result.back().comparable_distance;
+    }
+    report("knearest_iterative (stack)", explicit_stack.milliseconds(), n,
+           context.nodes_visited());
+
+    stopwatch batch;
+    tree.knearest_batch(w.queries, k, result, context);
+    checksum += result.back().comparable_distance;
+    report("knearest_batch", batch.milliseconds(), n, 0);
+}
+
+// Node orders after build(), with the cache and TLB misses of a pass of
+// knearest_iterative per query.
+void layouts(const workload &w, size_t k) {
+
+    std::printf("layouts, k = %zu (misses per query, -1 without perf counters)\n", k);
+
+    const tree_type::node_layout orders[] = {
+        tree_type::in_order, tree_type::breadth_first, tree_type::depth_first,
+        tree_type::van_emde_boas
+    };
+    const char *names[] = { "in_order", "breadth_first", "depth_first", "van_emde_boas" };
+
+    tree_type tree;
+    fill(tree, w);
+    tree.build();
+
+    tree_type::query_context context;
+    std::vector<tree_type::query_result> result;
+    const size_t n = w.queries.size();
+
+    for (size_t l = 0; l < 4; l++) {
+        tree.relayout(orders[l]);
+
+        perf_counter cache(perf_counter::cache_misses);
+        perf_counter tlb(perf_counter::tlb_misses);
+        cache.start();
+        tlb.start();
+        stopwatch time;
+        for (size_t i = 0; i < n; i++) {
+            tree.knearest_iterative(w.queries[i], k, result, context);
+            checksum += result.back().comparable_distance;
+        }
+        const double milliseconds = time.milliseconds();
+        const long long tlb_misses = tlb.stop();
+        const long long cache_misses = cache.stop();
+
+        std::printf("  %-32s %9.1f ms %9.1f cache %9.1f tlb\n", names[l], milliseconds,
+                    cache_misses < 0 ? -1.0 : double(cache_misses) / n,
+                    tlb_misses < 0 ? -1.0 : double(tlb_misses) / n);
+    }
+}
+
+// Build time against tree shape and query cost, the quality metrics of
+// the cheaper builds.
+void builds(const workload &w, size_t k) {
+
+    std::printf("builds, k = %zu\n", k);
+
+    const tree_type::build_strategy strategies[] = {
+        tree_type::median_build, tree_type::hilbert_build, tree_type::presorted_build
+    };
+    const char *names[] = { "median_build", "hilbert_build", "presorted_build" };
+
+    std::vector<tree_type::query_result> result;
+    const size_t n = w.queries.size();
+
+    for (size_t b = 0; b < 3; b++) {
+        tree_type tree;
+        fill(tree, w);
+        stopwatch build;
+        tree.build(strategies[b]);
+        const double build_milliseconds = build.milliseconds();
+        const tree_type::tree_statistics shape = tree.statistics();
+
+        tree_type::query_context context;
+        stopwatch query;
+        for (size_t i = 0; i < n; i++) {
+            tree.knearest_iterative(w.queries[i], k, result, context);
+            checksum += result.back().comparable_distance;
+        }
+
+        std::printf("  %-16s build %8.1f ms, height %3zu, mean depth %5.1f,"
+                    " queries %8.1f ms %7.1f nodes/query\n",
+                    names[b], build_milliseconds, shape.height, shape.mean_depth,
+                    query.milliseconds(), double(context.nodes_visited()) / n);
+    }
+}
+
+// Pruning against the split planes only, or against the bounding box of
+// every subtree.
+void boxes(const workload &w, size_t k) {
+
+    std::printf("bounding boxes, k = %zu\n", k);
+
+    std::vector<tree_type::query_result> result;
+    tree_type::query_result nearest;
+    const size_t n = w.queries.size();
+
+    for (int enabled = 0; enabled < 2; enabled++) {
+        tree_type tree;
+        tree.set_bounding_boxes(enabled != 0);
+        fill(tree, w);
+        tree.build();
+
+        tree_type::query_context context;
+        stopwatch single;
+        for (size_t i = 0; i < n; i++) {
+            tree.nearest_iterative(w.queries[i], nearest, context);
+            checksum += nearest.comparable_distance;
+        }
+        const double single_milliseconds = single.milliseconds();
+        const size_t single_visited = context.nodes_visited();
+
+        context.reset_statistics();
+        stopwatch many;
+        for (size_t i = 0; i < n; i++) {
+            tree.knearest_iterative(w.queries[i], k, result, context);
+            checksum += result.back().comparable_distance;
+        }
+
+        std::printf("  %-16s nearest_iterative %8.1f ms %7.1f nodes/query,"
+                    " knearest_iterative %8.1f ms %7.1f nodes/query\n",
+                    enabled ? "with boxes" : "planes only",
+                    single_milliseconds, double(single_visited) / n,
+                    many.milliseconds(), double(context.nodes_visited()) / n);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+
+    const size_t entries = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 1000000;
+    const size_t queries = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 100000;
+
+    std::printf("%zu entries, %zu queries\n\n", entries, queries);
+
+    workload w;
+    uniform(entries, queries, w);
+    traversals(w, 1);
+    traversals(w, 8);
+    layouts(w, 8);
+    std::printf("uniform ");
+    builds(w, 8);
+
+    workload c;
+    clustered(entries, queries, c);
+    std::printf("clustered ");
+    builds(c, 8);
+    std::printf("clustered ");
+    boxes(c, 8);
+
+    std::printf("\n(checksum %g)\n", checksum);
+    return 0;
+}
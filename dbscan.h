@@ -0,0 +1,238 @@
+#ifndef DBSCAN_H_
+#define DBSCAN_H_
+
+#include <kdtree.h>
+
+namespace spatial_index {
+
+// DBSCAN clustering (Ester et al.) of the entries of a built kdtree, so
+// the index the application already has answers the eps neighborhoods.
+//
+// An entry with at least min_points entries (itself included) within eps
+// is a core point, core points within eps of each other belong to the
+// same cluster, and any other entry within eps of a core point is a
+// border point of the cluster of its closest core point. The rest is
+// noise. Cluster numbers follow the first entry of every cluster in the
+// order of add().
+//
+// Core points are found on all threads, counting whole subtrees at once
+// when their box lies within eps and stopping at min_points. Clusters are
+// then merged on all threads into one concurrent union-find, without
+// keeping the neighborhoods around.
+template <typename Tree>
+class dbscan {
+
+    private:
+        typedef typename Tree::node_index node_index;
+        typedef typename Tree::kdnode kdnode;
+        typedef typename Tree::Cell Cell;
+        typedef typename Tree::point_type Point;
+
+    public:
+
+        static const int noise = -1;
+
+        dbscan(double eps, size_t min_points)
+            : m_eps(eps), m_min_points(min_points), m_clusters(0) {}
+        virtual ~dbscan() {}
+
+        // Clusters the entries of tree on the given number of threads, 0
+        // for one per core, and returns the number of clusters.
+        size_t run(const Tree &tree, unsigned threads = 0) {
+
+            const size_t n = tree.m_nodes.size();
+            m_labels.assign(n, noise);
+            m_core.assign(n, false);
+            m_clusters = 0;
+
+            if (tree.m_root == Tree::npos) {
+                return 0;
+            }
+
+            const Scan scan = {
+                tree, tree.m_counts, tree.m_metric.to_comparable(m_eps)
+            };
+
+            // By node index until the labels are written.
+            std::vector<char> core(n, false);
+            const size_t chunk = 1024;
+            const size_t chunks = (n + chunk - 1) / chunk;
+            util::parallel_for(chunks, threads, [&](size_t c) {
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) {
+                    const size_t found = count_within(scan, *tree.m_nodes[i].split,
+                                                      tree.m_root, tree.m_extent,
+                                                      m_min_points);
+                    core[i] = found >= m_min_points;
+                }
+            });
+
+            // Every core point links the core points after it, the others
+            // pick their closest core point.
+            util::concurrent_union_find groups(n);
+            std::vector<node_index> attached(n, Tree::npos);
+            util::parallel_for(chunks, threads, [&](size_t c) {
+                for (size_t i = c * chunk; i < std::min(n, (c + 1) * chunk); i++) {
+                    const kdnode &node = tree.m_nodes[i];
+                    if (core[i]) {
+                        link_within(scan, core, groups, static_cast<node_index>(i),
+                                    tree.m_root, tree.m_extent);
+                    } else {
+                        double best = scan.radius;
+                        attach(scan, core, *node.split, tree.m_root, tree.m_extent,
+                               best, attached[i]);
+                    }
+                }
+            });
+
+            std::vector<node_index> nodes(n);
+            for (size_t i = 0; i < n; i++) {
+                nodes[tree.m_nodes[i].entry] = static_cast<node_index>(i);
+            }
+
+            std::vector<int> numbers(n, noise);
+            for (size_t entry = 0; entry < n; entry++) {
+                const node_index i = nodes[entry];
+                m_core[entry] = core[i] != 0;
+                const node_index member = core[i] ? i : attached[i];
+                if (member == Tree::npos) {
+                    continue;
+                }
+                int &number = numbers[groups.find(member)];
+                if (number == noise) {
+                    number = static_cast<int>(m_clusters++);
+                }
+                m_labels[entry] = number;
+            }
+
+            return m_clusters;
+        }
+
+        // Cluster of every entry in the order of add(), or noise.
+        const std::vector<int> &labels() const { return m_labels; }
+
+        bool is_core(size_t entry) const { return m_core[entry]; }
+
+        size_t clusters() const { return m_clusters; }
+
+    private:
+        struct Scan {
+            const Tree &tree;
+            const std::vector<node_index> &counts;
+            double radius;
+        };
+
+        static const Cell &box_of(const Scan &scan, node_index index, const Cell &cell) {
+            return scan.tree.m_boxes.empty() ? cell : scan.tree.m_boxes[index];
+        }
+
+        // Entries within the radius of query, stopping at needed.
+        static size_t count_within(const Scan &scan, const Point &query,
+                                   node_index index, const Cell &cell, size_t needed) {
+
+            const Tree &tree = scan.tree;
+            const Cell &box = box_of(scan, index, cell);
+
+            if (tree.cell_distance(query, box) > scan.radius) {
+                return 0;
+            }
+            if (tree.far_distance(query, box) <= scan.radius) {
+                return scan.counts[index];
+            }
+
+            const kdnode &node = tree.m_nodes[index];
+            size_t count = tree.m_metric.distance(query, *node.split) <= scan.radius ? 1 : 0;
+
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != Tree::npos && count < needed) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                count += count_within(scan, query, node.left, lower, needed - count);
+            }
+            if (node.right != Tree::npos && count < needed) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                count += count_within(scan, query, node.right, upper, needed - count);
+            }
+            return count;
+        }
+
+        // Unites the core point at index from with the core points after it
+        // within the radius.
+        static void link_within(const Scan &scan, const std::vector<char> &core,
+                                util::concurrent_union_find &groups, node_index from,
+                                node_index index, const Cell &cell) {
+
+            const Tree &tree = scan.tree;
+            const Point &query = *tree.m_nodes[from].split;
+
+            if (tree.cell_distance(query, box_of(scan, index, cell)) > scan.radius) {
+                return;
+            }
+
+            const kdnode &node = tree.m_nodes[index];
+            if (index > from && core[index] &&
+                tree.m_metric.distance(query, *node.split) <= scan.radius) {
+                groups.unite(from, index);
+            }
+
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != Tree::npos) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                link_within(scan, core, groups, from, node.left, lower);
+            }
+            if (node.right != Tree::npos) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                link_within(scan, core, groups, from, node.right, upper);
+            }
+        }
+
+        // Closest core point within best of query, ties going to the
+        // smaller node index.
+        static void attach(const Scan &scan, const std::vector<char> &core,
+                           const Point &query, node_index index,
+                           const Cell &cell, double &best, node_index &closest) {
+
+            const Tree &tree = scan.tree;
+            if (tree.cell_distance(query, box_of(scan, index, cell)) > best) {
+                return;
+            }
+
+            const kdnode &node = tree.m_nodes[index];
+            if (core[index]) {
+                double d = tree.m_metric.distance(query, *node.split);
+                if (d < best || (d == best && index < closest)) {
+                    best = d;
+                    closest = index;
+                }
+            }
+
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != Tree::npos) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                attach(scan, core, query, node.left, lower, best, closest);
+            }
+            if (node.right != Tree::npos) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                attach(scan, core, query, node.right, upper, best, closest);
+            }
+        }
+
+        double m_eps;
+        size_t m_min_points;
+
+        std::vector<int> m_labels;
+        std::vector<bool> m_core;
+        size_t m_clusters;
+
+}; // class dbscan
+
+template <typename Tree>
+const int dbscan<Tree>::noise;
+
+} // namespace spatial_index
+
+#endif /* DBSCAN_H_ */
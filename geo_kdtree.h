@@ -0,0 +1,152 @@
+#ifndef GEO_KDTREE_H_
+#define GEO_KDTREE_H_
+
+#include <kdtree.h>
+
+namespace spatial_index {
+
+// Nearest neighbors on the sphere for longitude / latitude points. Every
+// entry is stored as the 3D unit vector pointing at it (Earth centered,
+// Earth fixed, on a unit sphere), and the chord between two such vectors
+// grows with the great circle distance. So the plain Euclidean kdtree
+// over the vectors finds the right neighbors across the antimeridian and
+// near the poles, with its usual axis plane pruning and no trigonometry
+// below the conversion of the query.
+//
+// Point is any boost::geometry point with longitude and latitude as its
+// first two coordinates, in degrees or radians as its coordinate system
+// says.
+template < typename Data,
+          typename Point = boost::geometry::model::point<
+              double, 2, boost::geometry::cs::geographic<boost::geometry::degree> >,
+          typename Split = median_split >
+class geo_kdtree {
+
+    private:
+        typedef boost::geometry::model::point<
+            double, 3, boost::geometry::cs::cartesian> Vector;
+        typedef kdtree<Data, Vector, Split> tree_type;
+
+    public:
+
+        // Distances are reported along the great circle of a sphere of the
+        // given radius, the mean Earth radius in meters by default.
+        explicit geo_kdtree(double radius = 6371008.8) : m_radius(radius) {}
+        virtual ~geo_kdtree() {}
+
+        void add(const Point *point, const Data *data) {
+            m_points.push_back(point);
+            m_data.push_back(data);
+        }
+
+        void build(typename tree_type::build_strategy strategy = tree_type::median_build) {
+            m_tree.clear();
+            m_vectors.resize(m_points.size());
+            for (size_t i = 0; i < m_points.size(); i++) {
+                m_vectors[i] = to_vector(*m_points[i]);
+                m_tree.add(&m_vectors[i], m_data[i]);
+            }
+            m_tree.build(strategy);
+        }
+
+        void clear() {
+            m_tree.clear();
+            m_points.clear();
+            m_data.clear();
+            m_vectors.clear();
+        }
+
+        // comparable_distance is the squared chord between the unit
+        // vectors, distance() the great circle distance.
+        struct query_result {
+            const Data *data;
+            const Point *point;
+            double comparable_distance;
+            double radius;
+
+            query_result()
+                : data(NULL), point(NULL), comparable_distance(0), radius(0) {}
+            query_result(const Data *d, const Point *p, double c, double r)
+                : data(d), point(p), comparable_distance(c), radius(r) {}
+
+            double distance() const {
+                double half_chord = std::sqrt(comparable_distance) / 2;
+                return 2 * radius * std::asin(std::min(half_chord, 1.0));
+            }
+        };
+
+        // Scratch buffers, one per thread, see kdtree::query_context.
+        class query_context {
+            public:
+                size_t nodes_visited() const { return m_tree.nodes_visited(); }
+                void reset_statistics() { m_tree.reset_statistics(); }
+
+            private:
+                friend class geo_kdtree;
+                typename tree_type::query_context m_tree;
+                std::vector<typename tree_type::query_result> m_matches;
+        };
+
+        bool nearest(const Point &query, query_result &result) const {
+            query_context context;
+            return nearest(query, result, context);
+        }
+
+        bool nearest(const Point &query, query_result &result,
+                     query_context &context) const {
+            typename tree_type::query_result match;
+            if (!m_tree.nearest_iterative(to_vector(query), match, context.m_tree)) {
+                return false;
+            }
+            result = make_result(match);
+            return true;
+        }
+
+        // Results are sorted by increasing distance.
+        void knearest(const Point &query, size_t k,
+                      std::vector<query_result> &result) const {
+            query_context context;
+            knearest(query, k, result, context);
+        }
+
+        void knearest(const Point &query, size_t k,
+                      std::vector<query_result> &result,
+                      query_context &context) const {
+            std::vector<typename tree_type::query_result> &matches = context.m_matches;
+            m_tree.knearest_iterative(to_vector(query), k, matches, context.m_tree);
+
+            result.resize(matches.size());
+            for (size_t i = 0; i < matches.size(); i++) {
+                result[i] = make_result(matches[i]);
+            }
+        }
+
+        // Unit vector of a longitude / latitude point.
+        static Vector to_vector(const Point &point) {
+            const double longitude = boost::geometry::get_as_radian<0>(point);
+            const double latitude = boost::geometry::get_as_radian<1>(point);
+            const double c = std::cos(latitude);
+            return Vector(c * std::cos(longitude), c * std::sin(longitude),
+                          std::sin(latitude));
+        }
+
+    private:
+        query_result make_result(const typename tree_type::query_result &match) const {
+            const size_t entry = match.point - &m_vectors[0];
+            return query_result(match.data, m_points[entry],
+                                match.comparable_distance, m_radius);
+        }
+
+        double m_radius;
+
+        std::vector<const Point *> m_points;
+        std::vector<const Data *> m_data;
+
+        std::vector<Vector> m_vectors;
+        tree_type m_tree;
+
+}; // class geo_kdtree
+
+} // namespace spatial_index
+
+#endif /* GEO_KDTREE_H_ */
@@ -0,0 +1,288 @@
+#ifndef KDFOREST_H_
+#define KDFOREST_H_
+
+#include <random>
+#include <kdtree.h>
+
+namespace spatial_index {
+
+// Randomized kd-forest for approximate nearest neighbors (Silpa-Anan and
+// Hartley). Every tree indexes the entries under its own random rotation,
+// so the trees split along different directions. A query descends all the
+// trees and then keeps expanding the most promising branch of any tree from
+// one shared best-bin-first queue, like nearest_iterative, until it has
+// visited checks nodes. Rotations preserve distances, so the candidates of
+// all the trees compare directly.
+template < typename Data,
+          typename Point = boost::geometry::model::d2::point_xy<double> >
+class kdforest {
+
+    private:
+        typedef kdtree<Data, Point> tree_type;
+        typedef typename tree_type::node_ptr node_ptr;
+        typedef typename tree_type::node_index node_index;
+
+        static const std::size_t Dimension = boost::geometry::dimension<Point>::value;
+
+        // Bound, tree, node.
+        struct Branch {
+            double distance;
+            size_t tree;
+            node_ptr node;
+            Branch(double d, size_t t, node_ptr n) : distance(d), tree(t), node(n) {}
+        };
+
+        struct SmallestOnTop {
+            bool operator()(const Branch &a, const Branch &b) const {
+                return a.distance > b.distance;
+            }
+        };
+
+        // Distance, entry.
+        typedef std::pair<double, size_t> Candidate;
+
+    public:
+
+        typedef typename tree_type::query_result query_result;
+
+        explicit kdforest(size_t trees = 4, unsigned seed = 5489u)
+            : m_tree_count(trees), m_seed(seed) {}
+        virtual ~kdforest() {}
+
+        void add(const Point *point, const Data *data) {
+            m_points.push_back(point);
+            m_data.push_back(data);
+        }
+
+        void build() {
+
+            m_trees.assign(m_tree_count, tree_type());
+            m_rotated.assign(m_tree_count, std::vector<Point>());
+            m_rotations.assign(m_tree_count, Rotation());
+
+            std::mt19937 random(m_seed);
+
+            for (size_t t = 0; t < m_tree_count; t++) {
+                random_rotation(random, m_rotations[t]);
+
+                std::vector<Point> &rotated = m_rotated[t];
+                rotated.resize(m_points.size());
+                for (size_t i = 0; i < m_points.size(); i++) {
+                    rotate(m_rotations[t], *m_points[i], rotated[i]);
+                    m_trees[t].add(&rotated[i], m_data[i]);
+                }
+                m_trees[t].build();
+            }
+        }
+
+        void clear() {
+            m_points.clear();
+            m_data.clear();
+            m_trees.clear();
+            m_rotated.clear();
+            m_rotations.clear();
+        }
+
+        // Scratch buffers, one per thread, see kdtree::query_context.
+        class query_context {
+            public:
+                query_context() : m_stamp(0) {}
+
+            private:
+                friend class kdforest;
+                std::vector<Branch> m_branches;
+                std::vector<Candidate> m_candidates;
+                std::vector<Point> m_queries;
+                std::vector<std::uint32_t> m_seen;
+                std::uint32_t m_stamp;
+        };
+
+        // Approximate k nearest neighbors sorted by increasing distance,
+        // visiting at most checks nodes over all the trees once k candidates
+        // are known. checks == 0 searches until the result is exact.
+        void knearest(const Point &query, size_t k, size_t checks,
+                      std::vector<query_result> &result) const {
+            query_context context;
+            knearest(query, k, checks, result, context);
+        }
+
+        void knearest(const Point &query, size_t k, size_t checks,
+                      std::vector<query_result> &result,
+                      query_context &context) const {
+
+            result.clear();
+
+            if (m_trees.empty() || m_points.empty() || k < 1) {
+                return;
+            }
+
+            std::vector<Branch> &branches = context.m_branches;
+            std::vector<Candidate> &candidates = context.m_candidates;
+            branches.clear();
+            candidates.clear();
+            start_query(context);
+
+            std::vector<Point> &queries = context.m_queries;
+            queries.resize(m_trees.size());
+            for (size_t t = 0; t < m_trees.size(); t++) {
+                rotate(m_rotations[t], query, queries[t]);
+            }
+
+            size_t visited = 0;
+
+            for (size_t t = 0; t < m_trees.size(); t++) {
+                descend(query, t, m_trees[t].node_at(m_trees[t].m_root), k,
+                        context, visited);
+            }
+
+            while (!branches.empty()) {
+                if (candidates.size() == k) {
+                    if (branches.front().distance >= candidates.front().first) {
+                        break;
+                    }
+                    if (checks > 0 && visited >= checks) {
+                        break;
+                    }
+                }
+
+                Branch branch = branches.front();
+                std::pop_heap(branches.begin(), branches.end(), SmallestOnTop());
+                branches.pop_back();
+
+                descend(query, branch.tree, branch.node, k, context, visited);
+            }
+
+            std::sort_heap(candidates.begin(), candidates.end());
+            result.resize(candidates.size());
+            for (size_t i = 0; i < candidates.size(); i++) {
+                size_t entry = candidates[i].second;
+                result[i] = query_result(m_data[entry], m_points[entry],
+                                         candidates[i].first);
+            }
+        }
+
+        bool nearest(const Point &query, size_t checks, query_result &result) const {
+            std::vector<query_result> results;
+            knearest(query, 1, checks, results);
+            if (results.empty()) {
+                return false;
+            }
+            result = results[0];
+            return true;
+        }
+
+    private:
+        struct Rotation {
+            double m[Dimension][Dimension];
+        };
+
+        // Follows the near side from node down to a leaf, queueing the far
+        // sides.
+        void descend(const Point &query, size_t tree, node_ptr node, size_t k,
+                     query_context &context, size_t &visited) const {
+
+            const tree_type &index = m_trees[tree];
+            const Point &rotated_query = context.m_queries[tree];
+            std::vector<Branch> &branches = context.m_branches;
+            std::vector<Candidate> &candidates = context.m_candidates;
+
+            while (node) {
+                visited++;
+
+                const size_t entry = node->split - &m_rotated[tree][0];
+                if (context.m_seen[entry] != context.m_stamp) {
+                    // First time any tree meets this entry.
+                    context.m_seen[entry] = context.m_stamp;
+                    double d = boost::geometry::comparable_distance(
+                        query, *m_points[entry]); // no square root
+                    if (candidates.size() < k || d < candidates.front().first) {
+                        candidates.push_back(Candidate(d, entry));
+                        std::push_heap(candidates.begin(), candidates.end());
+                        if (candidates.size() > k) {
+                            std::pop_heap(candidates.begin(), candidates.end());
+                            candidates.pop_back();
+                        }
+                    }
+                }
+
+                double dx = util::subtract(rotated_query, *node->split, node->axis);
+
+                node_ptr far = index.node_at(dx <= 0 ? node->right : node->left);
+                if (far && (candidates.size() < k || dx * dx < candidates.front().first)) {
+                    branches.push_back(Branch(dx * dx, tree, far));
+                    std::push_heap(branches.begin(), branches.end(), SmallestOnTop());
+                }
+
+                node = index.node_at(dx <= 0 ? node->left : node->right);
+            }
+        }
+
+        // Stamps tell which entries the current query already saw.
+        void start_query(query_context &context) const {
+            if (context.m_seen.size() != m_points.size() ||
+                context.m_stamp == std::numeric_limits<std::uint32_t>::max()) {
+                context.m_seen.assign(m_points.size(), 0);
+                context.m_stamp = 0;
+            }
+            context.m_stamp++;
+        }
+
+        // Uniformly random orthonormal matrix: Gram-Schmidt on Gaussian rows.
+        static void random_rotation(std::mt19937 &random, Rotation &rotation) {
+            std::normal_distribution<double> normal(0, 1);
+            for (std::size_t i = 0; i < Dimension; i++) {
+                double norm = 0;
+                do {
+                    for (std::size_t j = 0; j < Dimension; j++) {
+                        rotation.m[i][j] = normal(random);
+                    }
+                    for (std::size_t p = 0; p < i; p++) {
+                        double dot = 0;
+                        for (std::size_t j = 0; j < Dimension; j++) {
+                            dot += rotation.m[i][j] * rotation.m[p][j];
+                        }
+                        for (std::size_t j = 0; j < Dimension; j++) {
+                            rotation.m[i][j] -= dot * rotation.m[p][j];
+                        }
+                    }
+                    norm = 0;
+                    for (std::size_t j = 0; j < Dimension; j++) {
+                        norm += rotation.m[i][j] * rotation.m[i][j];
+                    }
+                } while (norm < 1e-12);
+
+                norm = std::sqrt(norm);
+                for (std::size_t j = 0; j < Dimension; j++) {
+                    rotation.m[i][j] /= norm;
+                }
+            }
+        }
+
+        static void rotate(const Rotation &rotation, const Point &point, Point &result) {
+            for (std::size_t i = 0; i < Dimension; i++) {
+                double value = 0;
+                for (std::size_t j = 0; j < Dimension; j++) {
+                    value += rotation.m[i][j] * util::get(point, j);
+                }
+                util::set(result, i, value);
+            }
+        }
+
+        size_t m_tree_count;
+        unsigned m_seed;
+
+        std::vector<const Point *> m_points;
+        std::vector<const Data *> m_data;
+
+        std::vector<tree_type> m_trees;
+        std::vector<std::vector<Point> > m_rotated;
+        std::vector<Rotation> m_rotations;
+
+}; // class kdforest
+
+template <typename Data, typename Point>
+const std::size_t kdforest<Data, Point>::Dimension;
+
+} // namespace spatial_index
+
+#endif /* KDFOREST_H_ */
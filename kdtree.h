@@ -1,9 +1,15 @@
 #ifndef KDTREE_H_
 #define KDTREE_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <memory>
 #include <limits>
-#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include <boost/geometry.hpp>
 #include <boost/geometry/geometries/point_xy.hpp>
 
@@ -24,12 +30,42 @@ namespace util {
         return dimension_extractor<Point, Dimension + 1, Count>::subtract(
             p1, p2, dimension);
       }
+
+      static inline typename boost::geometry::coordinate_type<Point>::type
+      get(const Point &p, std::size_t dimension) {
+
+        if (Dimension == dimension) {
+          return boost::geometry::get<Dimension>(p);
+        }
+        return dimension_extractor<Point, Dimension + 1, Count>::get(p, dimension);
+      }
+
+      static inline void
+      set(Point &p, std::size_t dimension,
+          typename boost::geometry::coordinate_type<Point>::type value) {
+
+        if (Dimension == dimension) {
+          boost::geometry::set<Dimension>(p, value);
+          return;
+        }
+        dimension_extractor<Point, Dimension + 1, Count>::set(p, dimension, value);
+      }
     };
 
     template <typename Point, std::size_t Count>
     struct dimension_extractor<Point, Count, Count> {
       static inline typename boost::geometry::default_distance_result<Point>::type
-      subtract(const Point &p1, const Point &p2, std::size_t dimension) {}
+      subtract(const Point &p1, const Point &p2, std::size_t dimension) {
+        return 0;
+      }
+
+      static inline typename boost::geometry::coordinate_type<Point>::type
+      get(const Point &, std::size_t) {
+        return 0;
+      }
+
+      static inline void
+      set(Point &, std::size_t, typename boost::geometry::coordinate_type<Point>::type) {}
     };
 
     template <typename Point>
@@ -40,60 +76,2623 @@ namespace util {
           boost::geometry::dimension<Point>::type::value>::subtract(p1, p2,
                                                                     dimension);
     }
+
+    template <typename Point>
+    typename boost::geometry::coordinate_type<Point>::type get(const Point &p,
+                                                               std::size_t dimension) {
+      return dimension_extractor<
+          Point, 0, boost::geometry::dimension<Point>::type::value>::get(p, dimension);
+    }
+
+    template <typename Point>
+    void set(Point &p, std::size_t dimension,
+             typename boost::geometry::coordinate_type<Point>::type value) {
+      dimension_extractor<
+          Point, 0, boost::geometry::dimension<Point>::type::value>::set(p, dimension,
+                                                                         value);
+    }
+
+    // Interleaves the lowest bits of each coordinate, most significant bit
+    // first and coordinate 0 first within a level (Z-order).
+    inline std::uint64_t morton_key(const std::uint32_t *coords,
+                                    std::size_t dimension, unsigned bits) {
+      std::uint64_t key = 0;
+      for (unsigned bit = bits; bit-- > 0;) {
+        for (std::size_t i = 0; i < dimension; i++) {
+          key = (key << 1) | ((coords[i] >> bit) & 1);
+        }
+      }
+      return key;
+    }
+
+    // Position along the Hilbert curve, using Skilling's transform
+    // ("Programming the Hilbert curve", 2004) to turn the coordinates into
+    // the transposed Hilbert index, which is then interleaved like a Morton
+    // key. coords is overwritten.
+    inline std::uint64_t hilbert_key(std::uint32_t *coords,
+                                     std::size_t dimension, unsigned bits) {
+      if (bits == 0) {
+        return 0;
+      }
+
+      const std::uint32_t m = std::uint32_t(1) << (bits - 1);
+
+      // Inverse undo: invert the low bits of coords[0] when the bit q of
+      // coords[i] is set, exchange them with coords[i] otherwise. Written
+      // without branches, they are unpredictable.
+      for (std::uint32_t q = m; q > 1; q >>= 1) {
+        const std::uint32_t p = q - 1;
+        for (std::size_t i = 0; i < dimension; i++) {
+          const std::uint32_t invert = 0 - ((coords[i] & q) != 0);
+          const std::uint32_t t = (coords[0] ^ coords[i]) & p & ~invert;
+          coords[0] ^= (p & invert) | t;
+          coords[i] ^= t;
+        }
+      }
+
+      // Gray encode
+      for (std::size_t i = 1; i < dimension; i++) {
+        coords[i] ^= coords[i - 1];
+      }
+      std::uint32_t t = 0;
+      for (std::uint32_t q = m; q > 1; q >>= 1) {
+        if (coords[dimension - 1] & q) {
+          t ^= q - 1;
+        }
+      }
+      for (std::size_t i = 0; i < dimension; i++) {
+        coords[i] ^= t;
+      }
+
+      return morton_key(coords, dimension, bits);
+    }
+
+    // Inverse of hilbert_key: the coordinates of the cell at position key.
+    inline void hilbert_coords(std::uint64_t key, std::size_t dimension,
+                               unsigned bits, std::uint32_t *coords) {
+      for (std::size_t i = 0; i < dimension; i++) {
+        coords[i] = 0;
+      }
+      for (unsigned bit = bits; bit-- > 0;) {
+        for (std::size_t i = 0; i < dimension; i++) {
+          std::size_t shift = bit * dimension + (dimension - 1 - i);
+          coords[i] |= static_cast<std::uint32_t>((key >> shift) & 1) << bit;
+        }
+      }
+      if (bits == 0) {
+        return;
+      }
+
+      // Gray decode
+      std::uint32_t t = coords[dimension - 1] >> 1;
+      for (std::size_t i = dimension - 1; i > 0; i--) {
+        coords[i] ^= coords[i - 1];
+      }
+      coords[0] ^= t;
+
+      // Undo excess work
+      const std::uint64_t n = std::uint64_t(2) << (bits - 1);
+      for (std::uint64_t q = 2; q != n; q <<= 1) {
+        const std::uint32_t p = static_cast<std::uint32_t>(q - 1);
+        for (std::size_t i = dimension; i-- > 0;) {
+          const std::uint32_t invert = 0 - ((coords[i] & q) != 0);
+          t = (coords[0] ^ coords[i]) & p & ~invert;
+          coords[0] ^= (p & invert) | t;
+          coords[i] ^= t;
+        }
+      }
+    }
+
+    // LSD radix sort on 64 bit keys, 11 bits per pass. Passes where all
+    // keys share the same digit are skipped, so short keys are cheap.
+    template <typename Value>
+    void radix_sort(std::vector<std::pair<std::uint64_t, Value> > &items) {
+      if (items.empty()) {
+        return;
+      }
+
+      const unsigned digit = 11;
+      const size_t buckets = size_t(1) << digit;
+      const std::uint64_t mask = buckets - 1;
+
+      std::vector<std::pair<std::uint64_t, Value> > buffer(items.size());
+      std::vector<size_t> offsets(buckets);
+
+      for (unsigned shift = 0; shift < 64; shift += digit) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for (size_t i = 0; i < items.size(); i++) {
+          offsets[(items[i].first >> shift) & mask]++;
+        }
+        if (offsets[(items[0].first >> shift) & mask] == items.size()) {
+          continue;
+        }
+
+        size_t sum = 0;
+        for (size_t i = 0; i < buckets; i++) {
+          size_t count = offsets[i];
+          offsets[i] = sum;
+          sum += count;
+        }
+        for (size_t i = 0; i < items.size(); i++) {
+          buffer[offsets[(items[i].first >> shift) & mask]++] = items[i];
+        }
+        items.swap(buffer);
+      }
+    }
+
+    // Cache hint for data needed a few steps ahead. Define
+    // SPATIAL_INDEX_NO_PREFETCH to turn it off.
+    inline void prefetch(const void *address) {
+#if defined(__GNUC__) && !defined(SPATIAL_INDEX_NO_PREFETCH)
+      __builtin_prefetch(address);
+#else
+      (void)address;
+#endif
+    }
+
+    // Calls body(i) for every i < count from the given number of threads,
+    // 0 for one per core. Indices are handed out one at a time, so tasks of
+    // uneven cost balance out. body must be safe to call concurrently.
+    template <typename Body>
+    void parallel_for(size_t count, unsigned threads, Body body) {
+      if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+      }
+      if (threads > count) {
+        threads = static_cast<unsigned>(count);
+      }
+      if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+          body(i);
+        }
+        return;
+      }
+
+      std::atomic<size_t> next(0);
+      auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+          body(i);
+        }
+      };
+
+      std::vector<std::thread> pool;
+      for (unsigned t = 1; t < threads; t++) {
+        pool.push_back(std::thread(work));
+      }
+      work();
+      for (size_t t = 0; t < pool.size(); t++) {
+        pool[t].join();
+      }
+    }
+
+    // Disjoint sets over 0 .. size - 1. The root of every set is its
+    // smallest element, so find() gives the same representative whatever
+    // the order of the unions.
+    class union_find {
+      public:
+        explicit union_find(size_t size) : m_parent(size) {
+          for (size_t i = 0; i < size; i++) {
+            m_parent[i] = i;
+          }
+        }
+
+        size_t find(size_t i) {
+          while (m_parent[i] != i) {
+            m_parent[i] = m_parent[m_parent[i]]; // path halving
+            i = m_parent[i];
+          }
+          return i;
+        }
+
+        // False when a and b already were in the same set.
+        bool unite(size_t a, size_t b) {
+          a = find(a);
+          b = find(b);
+          if (a == b) {
+            return false;
+          }
+          if (b < a) {
+            std::swap(a, b);
+          }
+          m_parent[b] = a;
+          return true;
+        }
+
+      private:
+        std::vector<size_t> m_parent;
+    };
+
+    // union_find for several threads at once. A root is only ever linked
+    // below a smaller root, by compare and swap, so roots are still the
+    // smallest elements of their sets.
+    class concurrent_union_find {
+      public:
+        explicit concurrent_union_find(size_t size) : m_parent(size) {
+          for (size_t i = 0; i < size; i++) {
+            m_parent[i].store(i, std::memory_order_relaxed);
+          }
+        }
+
+        size_t find(size_t i) {
+          for (;;) {
+            size_t parent = m_parent[i].load();
+            if (parent == i) {
+              return i;
+            }
+            size_t grandparent = m_parent[parent].load();
+            if (grandparent != parent) {
+              m_parent[i].compare_exchange_weak(parent, grandparent); // path halving
+            }
+            i = grandparent;
+          }
+        }
+
+        // False when a and b already were in the same set.
+        bool unite(size_t a, size_t b) {
+          for (;;) {
+            a = find(a);
+            b = find(b);
+            if (a == b) {
+              return false;
+            }
+            if (b < a) {
+              std::swap(a, b);
+            }
+            size_t root = b;
+            if (m_parent[b].compare_exchange_strong(root, a)) {
+              return true;
+            }
+          }
+        }
+
+      private:
+        std::vector<std::atomic<size_t> > m_parent;
+    };
 } // namespace util
 
 
+// Where a subtree is split: on axis, either at the median entry or at the
+// entry closest to value on the upper side (the largest one if they are all
+// below).
+struct split_plan {
+    std::size_t axis;
+    bool at_median;
+    double value;
+
+    explicit split_plan(std::size_t a) : axis(a), at_median(true), value(0) {}
+    split_plan(std::size_t a, double v) : axis(a), at_median(false), value(v) {}
+};
+
+// Split policies, the third template parameter of kdtree. choose() is given
+// the entries of the subtree being split and the cell they live in through
+// a Range providing size(), dimension(), depth(), coordinate(i, axis),
+// lower(axis) and upper(axis).
+
+// Cycles through the axes and splits at the median, the classic kd-tree.
+struct median_split {
+    template <typename Range>
+    static split_plan choose(const Range &range) {
+        return split_plan(range.depth() % range.dimension());
+    }
+};
+
+// Splits at the median along the axis the entries are most spread out on.
+struct max_spread_split {
+    template <typename Range>
+    static split_plan choose(const Range &range) {
+        std::size_t best = 0;
+        double best_spread = -1;
+        for (std::size_t axis = 0; axis < range.dimension(); axis++) {
+            double min = range.coordinate(0, axis);
+            double max = min;
+            for (size_t i = 1; i < range.size(); i++) {
+                double v = range.coordinate(i, axis);
+                min = std::min(min, v);
+                max = std::max(max, v);
+            }
+            if (max - min > best_spread) {
+                best = axis;
+                best_spread = max - min;
+            }
+        }
+        return split_plan(best);
+    }
+};
+
+// Splits the longest side of the cell in its middle, sliding the plane to
+// the closest entry when they all lie on one side (Maneewongvatana and
+// Mount). Cells keep a bounded aspect ratio on anisotropic data, at the
+// cost of balance.
+struct sliding_midpoint_split {
+    template <typename Range>
+    static split_plan choose(const Range &range) {
+        std::size_t best = 0;
+        double best_extent = -1;
+        for (std::size_t axis = 0; axis < range.dimension(); axis++) {
+            double extent = range.upper(axis) - range.lower(axis);
+            if (extent > best_extent) {
+                best = axis;
+                best_extent = extent;
+            }
+        }
+        if (!(best_extent > 0)) {
+            return split_plan(range.depth() % range.dimension());
+        }
+        return split_plan(best, range.lower(best) + best_extent / 2);
+    }
+};
+
+// Splits the longest side of the cell at the one of Bins - 1 evenly spaced
+// planes minimizing the surface area heuristic: on each side, the entries
+// times the surface of their bounding box. Falls back to the median.
+struct surface_area_split {
+    static const size_t Bins = 16;
+    static const size_t MaxDimension = 16;
+
+    template <typename Range>
+    static split_plan choose(const Range &range) {
+
+        const std::size_t dimension = std::min<std::size_t>(range.dimension(),
+                                                            std::size_t(MaxDimension));
+
+        std::size_t axis = 0;
+        for (std::size_t a = 1; a < dimension; a++) {
+            if (range.upper(a) - range.lower(a) > range.upper(axis) - range.lower(axis)) {
+                axis = a;
+            }
+        }
+
+        split_plan best(axis);
+
+        const double lo = range.lower(axis);
+        const double width = range.upper(axis) - lo;
+        if (!(width > 0)) {
+            return best;
+        }
+
+        // Count and bounding box of the entries falling in each bin.
+        size_t counts[Bins] = {0};
+        double boxes[Bins][2][MaxDimension];
+        for (size_t b = 0; b < Bins; b++) {
+            reset(boxes[b], dimension);
+        }
+        for (size_t i = 0; i < range.size(); i++) {
+            double bin = (range.coordinate(i, axis) - lo) / width * Bins;
+            size_t b = std::min<size_t>(Bins - 1, bin > 0 ? size_t(bin) : 0);
+            counts[b]++;
+            for (std::size_t a = 0; a < dimension; a++) {
+                double v = range.coordinate(i, a);
+                boxes[b][0][a] = std::min(boxes[b][0][a], v);
+                boxes[b][1][a] = std::max(boxes[b][1][a], v);
+            }
+        }
+
+        // Sweep from the top for the upper sides, then from the bottom.
+        double upper_cost[Bins];
+        double box[2][MaxDimension];
+        reset(box, dimension);
+        size_t above = 0;
+        for (size_t j = Bins; j-- > 1;) {
+            above += counts[j];
+            merge(box, boxes[j], dimension);
+            upper_cost[j] = above * surface(box, dimension);
+        }
+
+        double best_cost = std::numeric_limits<double>::max();
+        reset(box, dimension);
+        size_t below = 0;
+        for (size_t j = 1; j < Bins; j++) {
+            below += counts[j - 1];
+            merge(box, boxes[j - 1], dimension);
+            if (below == 0 || below == range.size()) {
+                continue;
+            }
+
+            double cost = below * surface(box, dimension) + upper_cost[j];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = split_plan(axis, lo + width * j / Bins);
+            }
+        }
+        return best;
+    }
+
+    static void reset(double (&box)[2][MaxDimension], std::size_t dimension) {
+        for (std::size_t a = 0; a < dimension; a++) {
+            box[0][a] = std::numeric_limits<double>::max();
+            box[1][a] = -std::numeric_limits<double>::max();
+        }
+    }
+
+    static void merge(double (&box)[2][MaxDimension],
+                      const double (&other)[2][MaxDimension], std::size_t dimension) {
+        for (std::size_t a = 0; a < dimension; a++) {
+            box[0][a] = std::min(box[0][a], other[0][a]);
+            box[1][a] = std::max(box[1][a], other[1][a]);
+        }
+    }
+
+    // Half the surface of a box: sum of the products of all but one side.
+    static double surface(const double (&box)[2][MaxDimension], std::size_t dimension) {
+        if (dimension == 1) {
+            return 1;
+        }
+        double sum = 0;
+        for (std::size_t skip = 0; skip < dimension; skip++) {
+            double product = 1;
+            for (std::size_t a = 0; a < dimension; a++) {
+                if (a != skip) {
+                    product *= std::max(0.0, box[1][a] - box[0][a]);
+                }
+            }
+            sum += product;
+        }
+        return sum;
+    }
+};
+
+
+// Metrics, the fourth template parameter of kdtree. Searches compare
+// comparable distances, anything growing with the true distance:
+//
+//   distance(a, b)  comparable distance between two points,
+//   plane(dx, axis) comparable distance to a point dx away along one axis
+//                   only,
+//   combine(a, b)   comparable distance from the plane terms of two axes,
+//   replace(c, old_term, new_term)
+//                   c with one of its terms grown from old_term to
+//                   new_term, for the incremental cell distance,
+//   to_distance(c) and to_comparable(d), static, convert,
+//
+// and the gaps along one axis fed to plane(), as in axis_gaps:
+//
+//   split_gap(dx, coordinate, axis)
+//                   from coordinate to everything across a split plane dx
+//                   away (dx = coordinate - split),
+//   gap(coordinate, lower, upper, axis)
+//                   from coordinate to an interval,
+//   gap(lower_a, upper_a, lower_b, upper_b, axis)
+//                   between two intervals,
+//   far_gap(coordinate, lower, upper, axis)
+//                   from coordinate to the farthest point of an interval.
+
+// Gaps of the plain, unbounded axes.
+struct axis_gaps {
+    double split_gap(double dx, double, std::size_t) const { return dx; }
+    double gap(double coordinate, double lower, double upper, std::size_t) const {
+        return coordinate < lower ? lower - coordinate
+             : coordinate > upper ? coordinate - upper : 0;
+    }
+    double gap(double lower_a, double upper_a, double lower_b, double upper_b,
+               std::size_t) const {
+        return upper_a < lower_b ? lower_b - upper_a
+             : upper_b < lower_a ? lower_a - upper_b : 0;
+    }
+    double far_gap(double coordinate, double lower, double upper, std::size_t) const {
+        return std::max(std::fabs(coordinate - lower), std::fabs(coordinate - upper));
+    }
+};
+
+// The default, squared distances.
+struct euclidean_metric : axis_gaps {
+    template <typename Point>
+    double distance(const Point &a, const Point &b) const {
+        return boost::geometry::comparable_distance(a, b);
+    }
+    double plane(double dx, std::size_t) const { return dx * dx; }
+    double combine(double a, double b) const { return a + b; }
+    double replace(double c, double old_term, double new_term) const {
+        return c - old_term + new_term;
+    }
+    static double to_distance(double c) { return std::sqrt(c); }
+    static double to_comparable(double d) { return d * d; }
+};
+
+// Manhattan distance, sum of the absolute differences.
+struct manhattan_metric : axis_gaps {
+    template <typename Point>
+    double distance(const Point &a, const Point &b) const {
+        double sum = 0;
+        for (std::size_t i = 0; i < boost::geometry::dimension<Point>::value; i++) {
+            sum += std::fabs(util::subtract(a, b, i));
+        }
+        return sum;
+    }
+    double plane(double dx, std::size_t) const { return std::fabs(dx); }
+    double combine(double a, double b) const { return a + b; }
+    double replace(double c, double old_term, double new_term) const {
+        return c - old_term + new_term;
+    }
+    static double to_distance(double c) { return c; }
+    static double to_comparable(double d) { return d; }
+};
+
+// Chebyshev distance, largest absolute difference. Terms only ever grow
+// in replace(), so the maximum stays exact.
+struct chebyshev_metric : axis_gaps {
+    template <typename Point>
+    double distance(const Point &a, const Point &b) const {
+        double largest = 0;
+        for (std::size_t i = 0; i < boost::geometry::dimension<Point>::value; i++) {
+            largest = std::max(largest, std::fabs(util::subtract(a, b, i)));
+        }
+        return largest;
+    }
+    double plane(double dx, std::size_t) const { return std::fabs(dx); }
+    double combine(double a, double b) const { return std::max(a, b); }
+    double replace(double c, double, double new_term) const {
+        return std::max(c, new_term);
+    }
+    static double to_distance(double c) { return c; }
+    static double to_comparable(double d) { return d; }
+};
+
+// Euclidean distance with a weight on every axis, squared. Unlike the
+// others it has state, and no default, so it must be passed to the kdtree
+// constructor.
+struct weighted_euclidean_metric : axis_gaps {
+    std::vector<double> weights;
+
+    // One weight per axis of the Point.
+    explicit weighted_euclidean_metric(const std::vector<double> &w) : weights(w) {}
+
+    template <typename Point>
+    double distance(const Point &a, const Point &b) const {
+        double sum = 0;
+        for (std::size_t i = 0; i < boost::geometry::dimension<Point>::value; i++) {
+            double d = util::subtract(a, b, i);
+            sum += weights[i] * d * d;
+        }
+        return sum;
+    }
+    double plane(double dx, std::size_t axis) const { return weights[axis] * dx * dx; }
+    double combine(double a, double b) const { return a + b; }
+    double replace(double c, double old_term, double new_term) const {
+        return c - old_term + new_term;
+    }
+    static double to_distance(double c) { return std::sqrt(c); }
+    static double to_comparable(double d) { return d * d; }
+};
+
+// Euclidean distance in a periodic domain, squared: every axis wraps
+// around from upper to lower, as in a simulation box with periodic
+// boundary conditions. Entries and queries must lie inside the domain.
+// The gaps take the shorter way round, so that whatever lies across a
+// split plane is as close as the plane or as the opposite domain boundary.
+struct periodic_metric : euclidean_metric {
+    std::vector<double> lower;
+    std::vector<double> upper;
+
+    // One bound per axis of the Point.
+    periodic_metric(const std::vector<double> &l, const std::vector<double> &u)
+        : lower(l), upper(u) {}
+
+    template <typename Point>
+    double distance(const Point &a, const Point &b) const {
+        double sum = 0;
+        for (std::size_t i = 0; i < boost::geometry::dimension<Point>::value; i++) {
+            double d = std::fabs(util::subtract(a, b, i));
+            d = std::min(d, upper[i] - lower[i] - d);
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    // The far side is [split, upper] when dx <= 0, else [lower, split].
+    double split_gap(double dx, double coordinate, std::size_t axis) const {
+        return dx <= 0 ? std::min(-dx, coordinate - lower[axis])
+                       : std::min(dx, upper[axis] - coordinate);
+    }
+    double gap(double coordinate, double l, double u, std::size_t axis) const {
+        return coordinate < l
+                   ? std::min(l - coordinate, coordinate - lower[axis] + upper[axis] - u)
+             : coordinate > u
+                   ? std::min(coordinate - u, upper[axis] - coordinate + l - lower[axis])
+             : 0;
+    }
+    double gap(double lower_a, double upper_a, double lower_b, double upper_b,
+               std::size_t axis) const {
+        return upper_a < lower_b
+                   ? std::min(lower_b - upper_a,
+                              lower_a - lower[axis] + upper[axis] - upper_b)
+             : upper_b < lower_a
+                   ? std::min(lower_a - upper_b,
+                              lower_b - lower[axis] + upper[axis] - upper_a)
+             : 0;
+    }
+    // Half the period when the point opposite to coordinate lies in the
+    // interval, otherwise at one of its ends.
+    double far_gap(double coordinate, double l, double u, std::size_t axis) const {
+        const double period = upper[axis] - lower[axis];
+        double opposite = coordinate + period / 2;
+        if (opposite >= upper[axis]) {
+            opposite -= period;
+        }
+        if (l <= opposite && opposite <= u) {
+            return period / 2;
+        }
+        const double a = std::fabs(coordinate - l);
+        const double b = std::fabs(coordinate - u);
+        return std::max(std::min(a, period - a), std::min(b, period - b));
+    }
+};
+
+
+// Aggregates, the last template parameter of kdtree: a summary of the
+// entries of every subtree, kept up to date by build() and relayout(), for
+// aggregate_within. An associative reduction over the Data:
+//
+//   value_type       the summary,
+//   identity()       summary of no entries,
+//   lift(data)       summary of one entry,
+//   combine(a, b)    summary of two disjoint groups.
+
+// The default, keeps nothing.
+struct no_aggregate {
+    struct value_type {};
+    value_type identity() const { return value_type(); }
+    template <typename Data>
+    value_type lift(const Data &) const { return value_type(); }
+    value_type combine(const value_type &, const value_type &) const { return value_type(); }
+};
+
+// Sum, minimum and maximum of Data itself, or of what it converts to.
+template <typename Value>
+struct sum_aggregate {
+    typedef Value value_type;
+    value_type identity() const { return Value(0); }
+    template <typename Data>
+    value_type lift(const Data &data) const { return static_cast<Value>(data); }
+    value_type combine(const value_type &a, const value_type &b) const { return a + b; }
+};
+
+template <typename Value>
+struct min_aggregate {
+    typedef Value value_type;
+    value_type identity() const { return std::numeric_limits<Value>::max(); }
+    template <typename Data>
+    value_type lift(const Data &data) const { return static_cast<Value>(data); }
+    value_type combine(const value_type &a, const value_type &b) const { return std::min(a, b); }
+};
+
+template <typename Value>
+struct max_aggregate {
+    typedef Value value_type;
+    value_type identity() const { return std::numeric_limits<Value>::lowest(); }
+    template <typename Data>
+    value_type lift(const Data &data) const { return static_cast<Value>(data); }
+    value_type combine(const value_type &a, const value_type &b) const { return std::max(a, b); }
+};
+
+
+template <typename Data, typename Point> class kdforest;
+template <typename Tree> class dbscan;
+
 template < typename Data,
-          typename Point = boost::geometry::model::d2::point_xy<double> >
+          typename Point = boost::geometry::model::d2::point_xy<double>,
+          typename Split = median_split,
+          typename Metric = euclidean_metric,
+          typename Aggregate = no_aggregate >
 class kdtree {
 
     public:
 
-        kdtree() {}
+        explicit kdtree(const Metric &metric = Metric(),
+                        const Aggregate &aggregate = Aggregate())
+            : m_root(npos), m_bounding_boxes(false), m_metric(metric),
+              m_aggregate(aggregate), m_reverse_k(0) {}
         virtual ~kdtree() {}
 
 
         void add(const Point *point, const Data *data) {
-            typename kdnode::ptr node = std::make_shared<kdnode>(point, data);
-            m_nodes.push_back(node);
+            m_nodes.push_back(kdnode(point, data, m_nodes.size()));
         }
 
-        void build() {
+        // median_build splits every subtree in place with nth_element or a
+        // partition, where the Split policy says. With the default
+        // median_split it cycles the axes and is balanced, O(n log n).
+        //
+        // hilbert_build sorts the entries once along the Hilbert curve (radix
+        // sort on 64 bit keys) and splits every subtree where the curve
+        // crosses from one half of its cell to the other, which is always an
+        // axis aligned plane. Cheaper, but the tree follows the spatial
+        // distribution rather than the counts, so it is deeper on clustered
+        // data; see statistics().
+        //
+        // presorted_build sorts the entries once per axis and keeps these
+        // lists sorted while splitting them at every level, O(kn log n). It
+        // builds the same shape as median_build, deterministically and
+        // without nth_element's bad cases on inputs full of duplicates.
+        // (Tied entries may go to the other side than with median_build,
+        // which changes the shape under policies that split by value.)
+        //
+        // The Split policy applies to median_build and presorted_build, the
+        // Hilbert build derives its splits from the curve.
+        enum build_strategy {
+            median_build,
+            hilbert_build,
+            presorted_build
+        };
+
+        void build(build_strategy strategy = median_build) {
             if (m_nodes.empty()) {
                 return;
             }
-            m_root = build(m_nodes, 0);
+            switch (strategy) {
+                case median_build:
+                    m_root = build(0, m_nodes.size(), 0);
+                    break;
+                case hilbert_build:
+                    m_root = build_hilbert();
+                    break;
+                case presorted_build:
+                    m_root = build_presorted();
+                    break;
+            }
+            bounds(0, m_nodes.size(), m_extent);
+            update_boxes();
+            update_aggregates();
+            m_reverse_radii.clear();
+            m_reverse_bounds.clear();
         }
 
         void clear() {
-            m_root.reset();
+            m_root = npos;
             m_nodes.clear();
+            m_boxes.clear();
+            m_counts.clear();
+            m_aggregates.clear();
+            m_reverse_radii.clear();
+            m_reverse_bounds.clear();
+        }
+
+        // Keep the bounding box of every subtree (2 * dimension doubles per
+        // node) so that nearest_iterative and knearest_iterative prune
+        // against the distance to the box instead of to the split plane.
+        // Much tighter on clustered data, where cells are mostly empty.
+        // Takes effect on the next build().
+        void set_bounding_boxes(bool enabled) {
+            m_bounding_boxes = enabled;
+            if (!enabled) {
+                m_boxes.clear();
+            }
+        }
+
+
+        struct tree_statistics {
+            size_t size;
+            size_t height;
+            double mean_depth; // root at depth 0
+        };
+
+        // Shape of the built tree, to compare build strategies.
+        tree_statistics statistics() const {
+            tree_statistics stats;
+            stats.size = 0;
+            stats.height = height(m_root);
+            size_t depth_sum = 0;
+            sum_depths(m_root, 0, stats.size, depth_sum);
+            stats.mean_depth = stats.size ? double(depth_sum) / stats.size : 0;
+            return stats;
+        }
+
+
+        // Order of the nodes in memory. build() leaves them in in-order
+        // (median) position, which puts a parent far away from its children
+        // near the root. The van Emde Boas layout recursively stores the top
+        // half of the tree before the bottom subtrees, so that every cache
+        // line or page holds a small complete subtree whatever its size.
+        enum node_layout {
+            in_order,
+            breadth_first,
+            depth_first,
+            van_emde_boas
+        };
+
+        // Permutes the built tree into the given layout. Query results are
+        // unaffected.
+        void relayout(node_layout layout) {
+
+            if (m_root == npos) {
+                return;
+            }
+
+            std::vector<node_index> order;
+            order.reserve(m_nodes.size());
+
+            switch (layout) {
+                case in_order:
+                    in_order_layout(m_root, order);
+                    break;
+                case breadth_first:
+                    breadth_first_layout(order);
+                    break;
+                case depth_first:
+                    depth_first_layout(m_root, order);
+                    break;
+                case van_emde_boas:
+                    van_emde_boas_layout(m_root, height(m_root), order);
+                    break;
+            }
+
+            permute(order);
+            update_boxes();
+            update_aggregates();
+            update_reverse_bounds();
+        }
+
+
+        // Result of a query: the matched entry and its distance to the query.
+        // comparable_distance is the one the Metric compares during the
+        // traversal (squared by default), distance() converts on demand.
+        struct query_result {
+            const Data *data;
+            const Point *point;
+            double comparable_distance;
+
+            query_result() : data(NULL), point(NULL), comparable_distance(0) {}
+            query_result(const Data *d, const Point *p, double c)
+                : data(d), point(p), comparable_distance(c) {}
+
+            double distance() const { return Metric::to_distance(comparable_distance); }
+        };
+
+
+        // Scratch buffers reused across queries, see below.
+        class query_context;
+
+
+        // Recursive and iterative methods.
+        const Data *nearest_recursive(const Point &query) const {
+            query_result result;
+            nearest_recursive(query, result);
+            return result.data;
+        }
+
+        bool nearest_recursive(const Point &query, query_result &result) const {
+
+            if (m_root == npos) {
+                return false;
+            }
+
+            best_match best(node_at(m_root), std::numeric_limits<double>::max());
+
+            double offsets[boost::geometry::dimension<Point>::value] = {0};
+            nearest(query, node_at(m_root), 0, offsets, best);
+
+            result = make_result(best.node, best.distance);
+            return true;
+        }
+
+        bool nearest_recursive(const Point &query, query_result &result,
+                               query_context &) const {
+            return nearest_recursive(query, result);
+        }
+
+        void knearest(const Point &query, size_t k, std::vector<const Data*> &result) const {
+            std::vector<query_result> matches;
+            knearest(query, k, matches);
+
+            result.resize(matches.size());
+            for (size_t i = 0; i < matches.size(); i++) {
+                result[i] = matches[i].data;
+            }
+        }
+
+        // Results are sorted by increasing distance.
+        void knearest(const Point &query, size_t k, std::vector<query_result> &result) const {
+            query_context context;
+            knearest(query, k, result, context);
+        }
+
+        void knearest(const Point &query, size_t k, std::vector<query_result> &result,
+                      query_context &context) const {
+
+            result.clear();
+
+            if (m_root == npos || k < 1) {
+                return;
+            }
+
+            MaxPriorityQueue priority_queue(context.m_heap);
+
+            double offsets[boost::geometry::dimension<Point>::value] = {0};
+            knearest(query, node_at(m_root), 0, offsets, k, priority_queue);
+
+            size_t size = priority_queue.size();
+
+            result.resize(size);
+
+            for (size_t i = 0; i < size; i++) {
+                // Reverse order
+                const DistanceTuple &top = priority_queue.top();
+                result[size - i - 1] = make_result(top.second, top.first);
+                priority_queue.pop();
+            }
+        }
+
+
+        // Same results as knearest, but walks the tree with an explicit stack
+        // instead of recursing.
+        void knearest_iterative(const Point &query, size_t k,
+                                std::vector<query_result> &result) const {
+            query_context context;
+            knearest_iterative(query, k, result, context);
+        }
+
+        void knearest_iterative(const Point &query, size_t k,
+                                std::vector<query_result> &result,
+                                query_context &context) const {
+
+            result.clear();
+
+            if (m_root == npos || k < 1) {
+                return;
+            }
+
+            MaxPriorityQueue priority_queue(context.m_heap);
+            DepthFirstStack stack(context.m_stack);
+
+            stack.push(DistanceTuple(0, node_at(m_root)));
+
+            DistanceTuple current;
+            while (!stack.empty()) {
+
+                stack.pop(current);
+
+                if (priority_queue.size() == k &&
+                    current.first >= priority_queue.top().first) {
+                    continue;
+                }
+
+                // Descend along the near side, leaving the far sides behind.
+                node_ptr currentNode = current.second;
+                while (currentNode) {
+                    context.m_visited++;
+                    double d = m_metric.distance(
+                        query, *currentNode->split); // no square root
+                    double dx = util::subtract(query, *currentNode->split,
+                                               currentNode->axis);
+
+                    if (priority_queue.size() < k || d <= priority_queue.top().first) {
+                        priority_queue.push(DistanceTuple(d, currentNode));
+                        if (priority_queue.size() > k) {
+                            priority_queue.pop();
+                        }
+                    }
+
+                    node_ptr far = node_at(dx <= 0 ? currentNode->right : currentNode->left);
+                    if (far) {
+                        util::prefetch(far);
+                        stack.push(DistanceTuple(
+                            lower_bound(query, far, dx, currentNode->axis), far));
+                    }
+
+                    currentNode = node_at(dx <= 0 ? currentNode->left : currentNode->right);
+                    util::prefetch(currentNode);
+
+                    // With boxes the near side can be out of reach as well.
+                    if (currentNode && !m_boxes.empty() && priority_queue.size() == k &&
+                        box_distance(query, currentNode) >= priority_queue.top().first) {
+                        break;
+                    }
+                }
+            }
+
+            size_t size = priority_queue.size();
+
+            result.resize(size);
+
+            for (size_t i = 0; i < size; i++) {
+                // Reverse order
+                const DistanceTuple &top = priority_queue.top();
+                result[size - i - 1] = make_result(top.second, top.first);
+                priority_queue.pop();
+            }
+        }
+
+
+        // Order in which a batch is executed. Sorting the queries along a
+        // space filling curve makes consecutive queries walk mostly the same
+        // nodes, which are then still in cache. Results are always reported
+        // in the order of the input.
+        enum query_order {
+            as_given,
+            morton_order,
+            hilbert_order
+        };
+
+        // Answers a batch of queries, results[i * k + j] holding the j-th
+        // neighbor of queries[i]. Rows are padded with empty results when
+        // the tree holds fewer than k entries.
+        //
+        // BatchGroup queries are walked in lockstep: each step visits one
+        // node of one query and prefetches what that query needs next, so
+        // the memory latency of one query is hidden behind the work on the
+        // others.
+        void knearest_batch(const std::vector<Point> &queries, size_t k,
+                            std::vector<query_result> &results,
+                            query_order order = as_given) const {
+            query_context context;
+            knearest_batch(queries, k, results, context, order);
+        }
+
+        void knearest_batch(const std::vector<Point> &queries, size_t k,
+                            std::vector<query_result> &results,
+                            query_context &context,
+                            query_order order = as_given) const {
+
+            results.assign(queries.size() * k, query_result());
+
+            if (m_root == npos || k < 1) {
+                return;
+            }
+
+            const std::vector<size_t> &sequence = context.m_order;
+            order_queries(queries, order, context);
+
+            BatchLane lanes[BatchGroup];
+            size_t next = 0;
+            size_t active = 0;
+
+            for (size_t i = 0; i < BatchGroup; i++) {
+                lanes[i].heap = &context.m_lane_heaps[i];
+                lanes[i].stack = &context.m_lane_stacks[i];
+                if (next < queries.size()) {
+                    start_lane(lanes[i], sequence[next++]);
+                    active++;
+                }
+            }
+
+            while (active > 0) {
+                for (size_t i = 0; i < BatchGroup; i++) {
+                    BatchLane &lane = lanes[i];
+                    if (lane.query == BatchIdle || step_lane(lane, queries[lane.query], k)) {
+                        continue;
+                    }
+
+                    // Done, emit the results in increasing distance.
+                    std::vector<DistanceTuple> &heap = *lane.heap;
+                    std::sort_heap(heap.begin(), heap.end(), LargestOnTop());
+                    for (size_t j = 0; j < heap.size(); j++) {
+                        results[lane.query * k + j] =
+                            make_result(heap[j].second, heap[j].first);
+                    }
+
+                    if (next < queries.size()) {
+                        start_lane(lane, sequence[next++]);
+                    } else {
+                        lane.query = BatchIdle;
+                        active--;
+                    }
+                }
+            }
+        }
+
+        void nearest_batch(const std::vector<Point> &queries,
+                           std::vector<query_result> &results,
+                           query_order order = as_given) const {
+            knearest_batch(queries, 1, results, order);
+        }
+
+        void nearest_batch(const std::vector<Point> &queries,
+                           std::vector<query_result> &results,
+                           query_context &context,
+                           query_order order = as_given) const {
+            knearest_batch(queries, 1, results, context, order);
+        }
+
+
+        const Data *nearest_iterative(const Point &query) const {
+            query_result result;
+            nearest_iterative(query, result);
+            return result.data;
+        }
+
+        bool nearest_iterative(const Point &query, query_result &result) const {
+            query_context context;
+            return nearest_iterative(query, result, context);
+        }
+
+        bool nearest_iterative(const Point &query, query_result &result,
+                               query_context &context) const {
+            if (m_root == npos) {
+                return false;
+            }
+
+            MinPriorityQueue priority_queue(context.m_heap);
+
+            best_match best(node_at(m_root), std::numeric_limits<double>::max());
+
+            priority_queue.push(DistanceTuple(0, node_at(m_root)));
+
+            while (!priority_queue.empty()) {
+
+                const auto current = priority_queue.top();
+
+                if (current.first >= best.distance) {
+                    break;
+                }
+
+                priority_queue.pop();
+
+                auto currentNode = current.second;
+                context.m_visited++;
+                double d = m_metric.distance(
+                    query, *currentNode->split); // no square root
+                double dx = util::subtract(query, *currentNode->split,
+                                           currentNode->axis);
+
+                if (d < best.distance) {
+                    best.node = currentNode;
+                    best.distance = d;
+                }
+
+                node_ptr near = node_at(dx <= 0 ? currentNode->left : currentNode->right);
+                node_ptr far = node_at(dx <= 0 ? currentNode->right : currentNode->left);
+
+                util::prefetch(far);
+                util::prefetch(near);
+
+                if (far)priority_queue.push(DistanceTuple(
+                    lower_bound(query, far, dx, currentNode->axis), far));
+                if (near) priority_queue.push(DistanceTuple(
+                    m_boxes.empty() ? 0 : box_distance(query, near), near));
+
+                // The next node to visit is known now, its record should
+                // already be on the way.
+                if (!priority_queue.empty()) {
+                    util::prefetch(priority_queue.top().second->split);
+                }
+            }
+
+            result = make_result(best.node, best.distance);
+            return true;
+        }
+
+
+        // Farthest entries, the knearest search turned around: subtrees are
+        // visited farthest bound first and dropped once even the farthest
+        // corner of their cell (or bounding box, when kept) is no farther
+        // than the k-th result. Results are sorted by decreasing distance.
+        bool farthest(const Point &query, query_result &result) const {
+            std::vector<query_result> results;
+            kfarthest(query, 1, results);
+            if (results.empty()) {
+                return false;
+            }
+            result = results[0];
+            return true;
+        }
+
+        void kfarthest(const Point &query, size_t k, std::vector<query_result> &result) const {
+            query_context context;
+            kfarthest(query, k, result, context);
+        }
+
+        void kfarthest(const Point &query, size_t k, std::vector<query_result> &result,
+                       query_context &context) const {
+
+            result.clear();
+
+            if (m_root == npos || k < 1) {
+                return;
+            }
+
+            MinPriorityQueue priority_queue(context.m_heap);
+            kfarthest(query, m_root, m_extent, k, priority_queue);
+
+            size_t size = priority_queue.size();
+
+            result.resize(size);
+
+            for (size_t i = 0; i < size; i++) {
+                // Reverse order
+                const DistanceTuple &top = priority_queue.top();
+                result[size - i - 1] = make_result(top.second, top.first);
+                priority_queue.pop();
+            }
+        }
+
+
+        // k entries nearest to a segment or a polyline, sorted by increasing
+        // distance. The best-first search of nearest_iterative, bounded by
+        // the distance from the line to the cell (or bounding box) of every
+        // subtree, so the line is never sampled into point queries.
+        // Distances are Euclidean whatever the Metric: comparable_distance
+        // holds the Metric's comparable of the Euclidean distance, so that
+        // distance() reports the Euclidean one.
+        // Planar points only, boost::geometry measures segments to boxes in
+        // two dimensions.
+        void knearest_to_segment(const boost::geometry::model::segment<Point> &segment,
+                                 size_t k, std::vector<query_result> &result) const {
+            query_context context;
+            knearest_to(segment, k, result, context);
+        }
+
+        void knearest_to_segment(const boost::geometry::model::segment<Point> &segment,
+                                 size_t k, std::vector<query_result> &result,
+                                 query_context &context) const {
+            knearest_to(segment, k, result, context);
+        }
+
+        void knearest_to_polyline(const boost::geometry::model::linestring<Point> &polyline,
+                                  size_t k, std::vector<query_result> &result) const {
+            query_context context;
+            knearest_to(polyline, k, result, context);
+        }
+
+        void knearest_to_polyline(const boost::geometry::model::linestring<Point> &polyline,
+                                  size_t k, std::vector<query_result> &result,
+                                  query_context &context) const {
+            knearest_to(polyline, k, result, context);
+        }
+
+
+        // Entries inside a boost::geometry polygon, multi-polygon or ring,
+        // boundary included, in no particular order and with a zero
+        // distance. Cells outside the envelope of the polygon are dropped
+        // right away. The others are compared with the polygon itself:
+        // subtrees of cells disjoint from it are skipped, subtrees of cells
+        // covered by it are reported without a test, and the entries of the
+        // remaining cells are tested one by one.
+        template <typename Polygon>
+        void query_within(const Polygon &polygon, std::vector<query_result> &result) const {
+
+            result.clear();
+
+            if (m_root == npos) {
+                return;
+            }
+
+            boost::geometry::model::box<Point> envelope;
+            boost::geometry::envelope(polygon, envelope);
+            Cell bounds;
+            for (std::size_t a = 0; a < boost::geometry::dimension<Point>::value; a++) {
+                bounds.lower[a] = util::get(envelope.min_corner(), a);
+                bounds.upper[a] = util::get(envelope.max_corner(), a);
+            }
+
+            query_within(polygon, bounds, m_root, m_extent, result);
+        }
+
+
+        // Count and Aggregate of the entries in a box, or within radius of
+        // center. Subtrees whose cell (or bounding box, when kept) lies
+        // entirely inside are consumed from their stored summary in one
+        // step, so only the nodes along the border are visited.
+        struct aggregate_result {
+            size_t count;
+            typename Aggregate::value_type value;
+        };
+
+        aggregate_result aggregate_within(const boost::geometry::model::box<Point> &box) const {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            Cell region;
+            for (std::size_t a = 0; a < dimension; a++) {
+                region.lower[a] = util::get(box.min_corner(), a);
+                region.upper[a] = util::get(box.max_corner(), a);
+            }
+            aggregate_result result = { 0, m_aggregate.identity() };
+            if (m_root != npos) {
+                aggregate_box(region, m_root, m_extent, result);
+            }
+            return result;
+        }
+
+        aggregate_result aggregate_within(const Point &center, double radius) const {
+            aggregate_result result = { 0, m_aggregate.identity() };
+            if (m_root != npos) {
+                aggregate_ball(center, Metric::to_comparable(radius), m_root, m_extent, result);
+            }
+            return result;
+        }
+
+
+        // Kernel of kernel_density, as a function of u = distance / bandwidth
+        // and scaled to 1 at u = 0: exp(-u^2 / 2) for the Gaussian, and
+        // 1 - u^2 up to u = 1 for the Epanechnikov kernel.
+        enum density_kernel {
+            gaussian_kernel,
+            epanechnikov_kernel
+        };
+
+        // Kernel density estimate at every point: densities[i] is the sum of
+        // the kernel over all entries at their distance from points[i], left
+        // to the caller to normalize.
+        //
+        // A subtree whose box is beyond the support of the kernel is skipped,
+        // and one across which the kernel varies by at most 2 * error is
+        // counted as its number of entries times the kernel midway between
+        // its nearest and farthest corner. Every entry is thus off by at most
+        // error, and with error = 0 only the exact zeros of the Epanechnikov
+        // kernel are left out. The points are shared out over the threads, 0
+        // for one per core.
+        void kernel_density(const std::vector<Point> &points, double bandwidth,
+                            std::vector<double> &densities,
+                            density_kernel kernel = gaussian_kernel,
+                            double error = 1e-6, unsigned threads = 0) const {
+
+            densities.assign(points.size(), 0.0);
+
+            if (m_root == npos || points.empty()) {
+                return;
+            }
+
+            std::vector<Cell> own_boxes;
+            const Density state = {
+                subtree_boxes(own_boxes), m_counts, bandwidth, kernel, 2 * error
+            };
+
+            // Chunks of neighboring points share most of their walk.
+            const size_t chunk = 64;
+            util::parallel_for((points.size() + chunk - 1) / chunk, threads, [&](size_t c) {
+                const size_t end = std::min(points.size(), (c + 1) * chunk);
+                for (size_t i = c * chunk; i < end; i++) {
+                    densities[i] = density(points[i], state, m_root);
+                }
+            });
+        }
+
+
+        // k nearest neighbors of every entry among the other entries, the
+        // self join: neighbors[i * k + j] is the j-th neighbor of the i-th
+        // entry added, rows padded as in knearest_batch. Entries at the same
+        // position are neighbors of each other.
+        //
+        // Nodes are handled parent first. The parent and its neighbors are k
+        // entries around the node, so the k-th closest of them bounds the
+        // search radius of the node before it visits anything. Below the top
+        // levels the subtrees are shared out over the threads, 0 for one per
+        // core.
+        void knearest_all(size_t k, std::vector<query_result> &neighbors,
+                          unsigned threads = 0) const {
+
+            neighbors.assign(m_nodes.size() * k, query_result());
+
+            if (m_root == npos || k < 1) {
+                return;
+            }
+
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+
+            // Rows by node index while searching.
+            std::vector<DistanceTuple> found(m_nodes.size() * k,
+                DistanceTuple(std::numeric_limits<double>::infinity(), node_ptr(NULL)));
+            std::vector<node_index> parents(m_nodes.size(), npos);
+
+            std::vector<node_index> top;
+            std::vector<node_index> subtrees;
+            split_top(threads, top, subtrees, &parents);
+
+            query_context context;
+            for (size_t i = 0; i < top.size(); i++) {
+                join_node(top[i], parents[top[i]], k, found, context);
+            }
+
+            util::parallel_for(subtrees.size(), threads, [&](size_t i) {
+                query_context local;
+                std::vector<std::pair<node_index, node_index> > pending(
+                    1, std::make_pair(subtrees[i], parents[subtrees[i]]));
+                while (!pending.empty()) {
+                    std::pair<node_index, node_index> current = pending.back();
+                    pending.pop_back();
+                    join_node(current.first, current.second, k, found, local);
+
+                    const kdnode &node = m_nodes[current.first];
+                    if (node.right != npos) {
+                        pending.push_back(std::make_pair(node.right, current.first));
+                    }
+                    if (node.left != npos) {
+                        pending.push_back(std::make_pair(node.left, current.first));
+                    }
+                }
+            });
+
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                size_t row = m_nodes[i].entry * k;
+                for (size_t j = 0; j < k && found[i * k + j].second; j++) {
+                    neighbors[row + j] = make_result(found[i * k + j].second,
+                                                     found[i * k + j].first);
+                }
+            }
+        }
+
+
+        // For every entry of queries its nearest entry in this tree,
+        // results[i] answering the i-th entry added to queries.
+        //
+        // Both trees are walked together, and a pair of subtrees is dropped
+        // once their bounding boxes lie farther apart than the worst answer
+        // found so far below the query subtree. Boxes come from the trees
+        // that keep them (set_bounding_boxes) and are computed for the
+        // others. Query subtrees are shared out over the threads, 0 for one
+        // per core. Distances are those of the Metric of this tree.
+        template <typename OtherData, typename OtherSplit, typename OtherMetric,
+                  typename OtherAggregate>
+        void nearest_join(const kdtree<OtherData, Point, OtherSplit, OtherMetric,
+                                       OtherAggregate> &queries,
+                          std::vector<query_result> &results,
+                          unsigned threads = 0) const {
+            std::vector<DistanceTuple> best;
+            join(queries, std::numeric_limits<double>::infinity(), best, NULL, threads);
+
+            results.assign(best.size(), query_result());
+            for (size_t i = 0; i < best.size(); i++) {
+                if (best[i].second) {
+                    results[queries.m_nodes[i].entry] =
+                        make_result(best[i].second, best[i].first);
+                }
+            }
+        }
+
+        // Same walk, results[i] holding every entry of this tree within
+        // radius of the i-th entry of queries, sorted by increasing distance.
+        template <typename OtherData, typename OtherSplit, typename OtherMetric,
+                  typename OtherAggregate>
+        void within_join(const kdtree<OtherData, Point, OtherSplit, OtherMetric,
+                                      OtherAggregate> &queries,
+                         double radius,
+                         std::vector<std::vector<query_result> > &results,
+                         unsigned threads = 0) const {
+            std::vector<DistanceTuple> best;
+            std::vector<JoinMatches> matches;
+            join(queries, Metric::to_comparable(radius), best, &matches, threads);
+
+            results.assign(queries.m_nodes.size(), std::vector<query_result>());
+            for (size_t t = 0; t < matches.size(); t++) {
+                for (size_t i = 0; i < matches[t].size(); i++) {
+                    const DistanceTuple &match = matches[t][i].second;
+                    results[queries.m_nodes[matches[t][i].first].entry].push_back(
+                        make_result(match.second, match.first));
+                }
+            }
+            for (size_t i = 0; i < results.size(); i++) {
+                std::sort(results[i].begin(), results[i].end(), CloserResult());
+            }
+        }
+
+
+        // Every pair of entries at most eps apart, as positions in the
+        // order of add(), first < second, sorted. The tree is joined with
+        // itself: the entry of every node against the subtrees below it,
+        // and the two subtrees of every node against each other, so each
+        // pair is met once.
+        void find_pairs_within(double eps, std::vector<std::pair<size_t, size_t> > &pairs,
+                               unsigned threads = 0) const {
+
+            pairs.clear();
+
+            if (m_root == npos) {
+                return;
+            }
+
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+
+            std::vector<Cell> own_boxes;
+            const std::vector<Cell> &boxes = subtree_boxes(own_boxes);
+            const double bound = Metric::to_comparable(eps);
+            std::vector<DistanceTuple> best(m_nodes.size(), DistanceTuple(bound, node_ptr(NULL)));
+            std::vector<double> bounds(m_nodes.size(), bound);
+
+            std::vector<node_index> top;
+            std::vector<node_index> subtrees;
+            split_top(threads, top, subtrees, NULL);
+
+            std::vector<JoinMatches> matches(top.size() + subtrees.size());
+            util::parallel_for(matches.size(), threads, [&](size_t i) {
+                Join<kdtree> state = { *this, boxes, boxes, best, bounds, &matches[i] };
+                if (i < top.size()) {
+                    self_join_node(state, top[i]);
+                } else {
+                    self_join(state, subtrees[i - top.size()]);
+                }
+            });
+
+            for (size_t t = 0; t < matches.size(); t++) {
+                for (size_t i = 0; i < matches[t].size(); i++) {
+                    size_t a = m_nodes[matches[t][i].first].entry;
+                    size_t b = matches[t][i].second.second->entry;
+                    pairs.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+                }
+            }
+            std::sort(pairs.begin(), pairs.end());
+        }
+
+        // The two closest entries, false with fewer than two entries.
+        bool closest_pair(query_result &first, query_result &second,
+                          unsigned threads = 0) const {
+            std::vector<query_result> neighbors;
+            knearest_all(1, neighbors, threads);
+
+            size_t closest = neighbors.size();
+            for (size_t i = 0; i < neighbors.size(); i++) {
+                if (neighbors[i].data && (closest == neighbors.size() ||
+                    neighbors[i].comparable_distance < neighbors[closest].comparable_distance)) {
+                    closest = i;
+                }
+            }
+            if (closest == neighbors.size()) {
+                return false;
+            }
+
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                if (m_nodes[i].entry == closest) {
+                    first = make_result(&m_nodes[i], 0);
+                    break;
+                }
+            }
+            second = neighbors[closest];
+            return true;
+        }
+
+        // Collapses groups of near duplicates: entries at most eps apart are
+        // linked, transitively, and representatives[i] is the first entry
+        // (in the order of add()) of the group of the i-th entry.
+        void merge_within(double eps, std::vector<size_t> &representatives,
+                          unsigned threads = 0) const {
+            std::vector<std::pair<size_t, size_t> > pairs;
+            find_pairs_within(eps, pairs, threads);
+
+            util::union_find groups(m_nodes.size());
+            for (size_t i = 0; i < pairs.size(); i++) {
+                groups.unite(pairs[i].first, pairs[i].second);
+            }
+
+            representatives.resize(m_nodes.size());
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                representatives[i] = groups.find(i);
+            }
+        }
+
+        // Reverse k nearest neighbors: the entries that would have query
+        // among their k nearest, that is no farther than their k-th nearest
+        // other entry, sorted by increasing distance.
+        //
+        // prepare_reverse_knearest() finds that distance for every entry
+        // with knearest_all, and the largest one below every node. It is
+        // run once after build(), which drops it again. A query then skips
+        // every subtree whose box is farther than the largest distance
+        // below it. Entries with fewer than k others have everything among
+        // their k nearest.
+        void prepare_reverse_knearest(size_t k, unsigned threads = 0) {
+            std::vector<query_result> neighbors;
+            knearest_all(k, neighbors, threads);
+
+            m_reverse_k = k;
+            m_reverse_radii.assign(m_nodes.size(), std::numeric_limits<double>::infinity());
+            for (size_t i = 0; i < m_nodes.size() && k > 0; i++) {
+                const query_result &last = neighbors[i * k + k - 1];
+                if (last.data) {
+                    m_reverse_radii[i] = last.comparable_distance;
+                }
+            }
+            update_reverse_bounds();
+        }
+
+        // Empty until prepare_reverse_knearest() ran.
+        void reverse_knearest(const Point &query, std::vector<query_result> &result) const {
+            result.clear();
+            if (m_root == npos || m_reverse_radii.empty()) {
+                return;
+            }
+            reverse_knearest(query, m_root, m_extent, result);
+            std::sort(result.begin(), result.end(), CloserResult());
+        }
+
+        // k of the last prepare_reverse_knearest().
+        size_t reverse_k() const { return m_reverse_k; }
+
+
+        // Farthest point sampling: starting from entry first, repeatedly
+        // picks the entry farthest from all the samples so far, m entries
+        // at most, as positions in the order of add().
+        //
+        // Every node keeps the distance from its entry to the closest sample
+        // and the largest such distance below it. A new sample only visits
+        // the subtrees whose box is closer to it than that largest distance,
+        // and the next sample is found by following the largest distance
+        // down from the root. Subtrees are updated on the threads, 0 for one
+        // per core.
+        void farthest_point_sampling(size_t m, std::vector<size_t> &samples,
+                                     size_t first = 0, unsigned threads = 0) const {
+
+            samples.clear();
+
+            if (m_root == npos || m < 1 || first >= m_nodes.size()) {
+                return;
+            }
+
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+
+            std::vector<Cell> own_boxes;
+            const std::vector<Cell> &boxes = subtree_boxes(own_boxes);
+
+            std::vector<node_index> top;
+            std::vector<node_index> subtrees;
+            split_top(threads, top, subtrees, NULL);
+
+            // Samples are at -1, below any distance.
+            Sampling state = {
+                boxes,
+                std::vector<double>(m_nodes.size(), std::numeric_limits<double>::infinity()),
+                std::vector<double>(m_nodes.size(), std::numeric_limits<double>::infinity()),
+                NULL
+            };
+
+            node_index sample = npos;
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                if (m_nodes[i].entry == first) {
+                    sample = static_cast<node_index>(i);
+                }
+            }
+
+            while (samples.size() < m && sample != npos) {
+                samples.push_back(m_nodes[sample].entry);
+                state.sample = &m_nodes[sample];
+                state.closest[sample] = -1;
+
+                util::parallel_for(subtrees.size(), threads, [&](size_t i) {
+                    sample_subtree(state, subtrees[i]);
+                });
+                for (size_t i = top.size(); i-- > 0;) {
+                    sample_node(state, top[i]);
+                    update_largest(state, top[i]);
+                }
+
+                sample = farthest_sample(state);
+            }
+        }
+
+
+    private:
+        template <typename, typename, typename, typename, typename> friend class kdtree;
+        template <typename, typename> friend class kdforest;
+        template <typename> friend class dbscan;
+
+        typedef Point point_type;
+
+        // Nodes live in one contiguous array and refer to their children by
+        // index, which keeps them small and lets relayout() move them.
+        typedef std::uint32_t node_index;
+        static const node_index npos = static_cast<node_index>(-1);
+
+        struct kdnode {
+            node_index left;
+            node_index right;
+
+            int axis;
+            node_index entry; // position in the order of add()
+
+            const Point *split;
+            const Data *data;
+
+            kdnode(const Point *g, const Data *d, size_t e)
+                : left(npos), right(npos), axis(0),
+                  entry(static_cast<node_index>(e)), split(g), data(d) {}
+        };
+
+        typedef const kdnode *node_ptr;
+
+        typedef std::vector<kdnode> Nodes;
+
+        // Bounds of the region a subtree covers, as narrowed down by the
+        // splits above it, or of the entries it holds.
+        struct Cell {
+            double lower[boost::geometry::dimension<Point>::value];
+            double upper[boost::geometry::dimension<Point>::value];
+        };
+        typedef std::pair<double, node_ptr> DistanceTuple;
+
+        struct SmallestOnTop {
+            bool operator()(const DistanceTuple &a, const DistanceTuple &b) const {
+                return a.first > b.first;
+            }
+        };
+        struct LargestOnTop {
+            bool operator()(const DistanceTuple &a, const DistanceTuple &b) const {
+                return a.first < b.first;
+            }
+        };
+
+        // std::priority_queue owns its container, so every query would
+        // allocate. This one works on storage borrowed from a query_context
+        // and keeps its capacity between queries.
+        template <typename Compare>
+        class BorrowedPriorityQueue {
+            public:
+                explicit BorrowedPriorityQueue(std::vector<DistanceTuple> &c)
+                    : m_c(c) {
+                    m_c.clear();
+                }
+
+                bool empty() const { return m_c.empty(); }
+                size_t size() const { return m_c.size(); }
+                const DistanceTuple &top() const { return m_c.front(); }
+
+                void push(const DistanceTuple &value) {
+                    m_c.push_back(value);
+                    std::push_heap(m_c.begin(), m_c.end(), Compare());
+                }
+
+                void pop() {
+                    std::pop_heap(m_c.begin(), m_c.end(), Compare());
+                    m_c.pop_back();
+                }
+
+            private:
+                std::vector<DistanceTuple> &m_c;
+        };
+
+        typedef BorrowedPriorityQueue<SmallestOnTop> MinPriorityQueue;
+        typedef BorrowedPriorityQueue<LargestOnTop> MaxPriorityQueue;
+
+        // Pending subtree of a best-first search that carries the cells.
+        struct CellTuple {
+            double distance;
+            node_ptr node;
+            Cell cell;
+        };
+
+        struct NearestCellOnTop {
+            bool operator()(const CellTuple &a, const CellTuple &b) const {
+                return a.distance > b.distance;
+            }
+        };
+
+        Nodes m_nodes;
+        node_index m_root;
+
+        // Bounding box of the subtree below every node, when enabled.
+        bool m_bounding_boxes;
+        std::vector<Cell> m_boxes;
+
+        // Bounds of all the entries, the cell of the root.
+        Cell m_extent;
+
+        Metric m_metric;
+
+        // Entry count of the subtree below every node, and its Aggregate
+        // unless that is no_aggregate.
+        Aggregate m_aggregate;
+        std::vector<node_index> m_counts;
+        std::vector<typename Aggregate::value_type> m_aggregates;
+
+        // Comparable distance from every entry (in the order of add()) to
+        // its k-th nearest other entry, and the largest of these below every
+        // node, once prepare_reverse_knearest() ran.
+        size_t m_reverse_k;
+        std::vector<double> m_reverse_radii;
+        std::vector<double> m_reverse_bounds;
+
+        // Queries in flight in knearest_batch.
+        static const size_t BatchGroup = 8;
+        static const size_t BatchIdle = static_cast<size_t>(-1);
+
+        // State of one query of a batch: a depth-first traversal like
+        // knearest_iterative, suspended between two node visits.
+        struct BatchLane {
+            size_t query;
+            node_ptr current;
+            bool prefetched;
+            std::vector<DistanceTuple> *heap;
+            std::vector<DistanceTuple> *stack;
+
+            BatchLane()
+                : query(BatchIdle), current(NULL), prefetched(false),
+                  heap(NULL), stack(NULL) {}
+        };
+
+    public:
+        // Owns the buffers a query needs. Keep one per thread and pass it to
+        // every query: once the buffers have grown to the working size no
+        // further allocation takes place. A context must not be shared by
+        // concurrent queries.
+        class query_context {
+            public:
+                query_context() : m_visited(0) {}
+
+                void reserve(size_t n) { m_heap.reserve(n); }
+
+                // Nodes visited by nearest_iterative and knearest_iterative
+                // since the last reset, a measure of query cost.
+                size_t nodes_visited() const { return m_visited; }
+                void reset_statistics() { m_visited = 0; }
+
+            private:
+                friend class kdtree;
+                size_t m_visited;
+                std::vector<DistanceTuple> m_heap;
+                std::vector<DistanceTuple> m_stack;
+                std::vector<DistanceTuple> m_lane_heaps[BatchGroup];
+                std::vector<DistanceTuple> m_lane_stacks[BatchGroup];
+                std::vector<size_t> m_order;
+                std::vector<std::pair<std::uint64_t, size_t> > m_keys;
+                std::vector<double> m_distances;
+                std::vector<CellTuple> m_cells;
+        };
+
+    private:
+
+
+        template<typename NODE_TYPE>
+        struct Sort : std::binary_function<NODE_TYPE, NODE_TYPE, bool> {
+
+            Sort(std::size_t dimension) : m_dimension(dimension) {}
+
+            bool operator()(const NODE_TYPE &lhs, const NODE_TYPE &rhs) const {
+                return util::subtract(*lhs.split, *rhs.split, m_dimension) < 0;
+            }
+            std::size_t m_dimension;
+        };
+
+        struct best_match {
+            node_ptr node;
+            double distance;
+            best_match(const node_ptr &n, double d) : node(n), distance(d) {}
+        };
+
+        // Views of a subtree for Split::choose().
+        struct InPlaceRange {
+            const Nodes &nodes;
+            size_t begin;
+            size_t end;
+            const Cell &cell;
+            int level;
+
+            InPlaceRange(const Nodes &n, size_t b, size_t e, const Cell &c, int d)
+                : nodes(n), begin(b), end(e), cell(c), level(d) {}
+
+            size_t size() const { return end - begin; }
+            std::size_t dimension() const { return boost::geometry::dimension<Point>::value; }
+            int depth() const { return level; }
+            double lower(std::size_t axis) const { return cell.lower[axis]; }
+            double upper(std::size_t axis) const { return cell.upper[axis]; }
+            double coordinate(size_t i, std::size_t axis) const {
+                return util::get(*nodes[begin + i].split, axis);
+            }
+        };
+
+        struct Below {
+            std::size_t axis;
+            double value;
+            Below(std::size_t a, double v) : axis(a), value(v) {}
+            bool operator()(const kdnode &node) const {
+                return util::get(*node.split, axis) < value;
+            }
+        };
+
+        void bounds(size_t begin, size_t end, Cell &cell) const {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            for (std::size_t a = 0; a < dimension; a++) {
+                cell.lower[a] = std::numeric_limits<double>::max();
+                cell.upper[a] = -std::numeric_limits<double>::max();
+                for (size_t i = begin; i < end; i++) {
+                    double v = util::get(*m_nodes[i].split, a);
+                    cell.lower[a] = std::min(cell.lower[a], v);
+                    cell.upper[a] = std::max(cell.upper[a], v);
+                }
+            }
+        }
+
+        node_index build(size_t begin, size_t end, int depth) {
+            Cell cell;
+            bounds(begin, end, cell);
+            return build(begin, end, depth, cell);
+        }
+
+        // Builds the subtree of m_nodes[begin, end) in place, every node ends
+        // up between its lower and upper subtrees.
+        node_index build(size_t begin, size_t end, int depth, const Cell &cell) {
+
+            if (begin == end) {
+                return npos;
+            }
+
+            split_plan plan = Split::choose(InPlaceRange(m_nodes, begin, end, cell, depth));
+
+            size_t split;
+            if (plan.at_median) {
+                split = begin + (end - begin) / 2;
+                std::nth_element(m_nodes.begin() + begin, m_nodes.begin() + split,
+                                 m_nodes.begin() + end, Sort<kdnode>(plan.axis));
+            } else {
+                split = std::partition(m_nodes.begin() + begin, m_nodes.begin() + end,
+                                       Below(plan.axis, plan.value)) - m_nodes.begin();
+                if (split == end) {
+                    // Everything below, slide down to the largest entry.
+                    split = end - 1;
+                    std::swap(m_nodes[split],
+                              *std::max_element(m_nodes.begin() + begin, m_nodes.begin() + end,
+                                                Sort<kdnode>(plan.axis)));
+                } else {
+                    std::swap(m_nodes[split],
+                              *std::min_element(m_nodes.begin() + split, m_nodes.begin() + end,
+                                                Sort<kdnode>(plan.axis)));
+                }
+            }
+
+            const double value = util::get(*m_nodes[split].split, plan.axis);
+            Cell lower = cell;
+            lower.upper[plan.axis] = value;
+            Cell upper = cell;
+            upper.lower[plan.axis] = value;
+
+            node_index left = build(begin, split, depth + 1, lower);
+            node_index right = build(split + 1, end, depth + 1, upper);
+
+            kdnode &node = m_nodes[split];
+            node.axis = static_cast<int>(plan.axis);
+            node.left = left;
+            node.right = right;
+
+            return static_cast<node_index>(split);
+        }
+
+        struct HilbertBuild {
+            unsigned bits;
+            std::vector<std::uint64_t> keys;
+            std::vector<double> coords;
+        };
+
+        node_index build_hilbert() {
+
+            // 16 bits per axis are plenty to tell the entries apart, entries
+            // sharing a cell are finished off with the median build. Shorter
+            // keys also mean fewer radix passes.
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const unsigned bits = std::min<unsigned>(16, 64 / dimension);
+            const double cells = std::ldexp(1.0, bits) - 1;
+
+            double low[dimension];
+            double scale[dimension];
+            for (std::size_t a = 0; a < dimension; a++) {
+                double min = util::get(*m_nodes[0].split, a);
+                double max = min;
+                for (size_t i = 1; i < m_nodes.size(); i++) {
+                    double v = util::get(*m_nodes[i].split, a);
+                    min = std::min(min, v);
+                    max = std::max(max, v);
+                }
+                low[a] = min;
+                scale[a] = max > min ? cells / (max - min) : 0;
+            }
+
+            std::vector<std::pair<std::uint64_t, node_index> > order(m_nodes.size());
+            std::uint32_t coords[dimension];
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                for (std::size_t a = 0; a < dimension; a++) {
+                    coords[a] = static_cast<std::uint32_t>(
+                        (util::get(*m_nodes[i].split, a) - low[a]) * scale[a]);
+                }
+                order[i] = std::make_pair(util::hilbert_key(coords, dimension, bits),
+                                          static_cast<node_index>(i));
+            }
+
+            util::radix_sort(order);
+
+            // Entries, keys and coordinates in curve order. The coordinates
+            // are copied so that the splits scan contiguous memory.
+            HilbertBuild state;
+            state.bits = bits;
+            state.keys.resize(m_nodes.size());
+            state.coords.resize(m_nodes.size() * dimension);
+            Nodes nodes;
+            nodes.reserve(m_nodes.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                const kdnode &node = m_nodes[order[i].second];
+                nodes.push_back(node);
+                state.keys[i] = order[i].first;
+                for (std::size_t a = 0; a < dimension; a++) {
+                    state.coords[i * dimension + a] = util::get(*node.split, a);
+                }
+            }
+            m_nodes.swap(nodes);
+
+            return build_hilbert(0, m_nodes.size(), int(bits * dimension) - 1,
+                                 state, 0);
+        }
+
+        // m_nodes[begin, end) is sorted by key and all keys agree above bit.
+        // The first bit on which they differ halves the curve into two boxes
+        // separated along one axis. The node is the entry of the upper box
+        // closest to the plane, so that the usual invariant holds: the lower
+        // subtree is below the node on its axis and the upper one above.
+        node_index build_hilbert(size_t begin, size_t end, int bit,
+                                 HilbertBuild &state, int depth) {
+
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const std::vector<std::uint64_t> &keys = state.keys;
+
+            if (begin == end) {
+                return npos;
+            }
+            if (end - begin == 1) {
+                kdnode &node = m_nodes[begin];
+                node.axis = depth % boost::geometry::dimension<Point>();
+                node.left = npos;
+                node.right = npos;
+                return static_cast<node_index>(begin);
+            }
+
+            size_t mid = begin;
+            for (; bit >= 0; bit--) {
+                // First key with the bit set.
+                const std::uint64_t mask = std::uint64_t(1) << bit;
+                size_t lo = begin, hi = end;
+                while (lo < hi) {
+                    size_t m = lo + (hi - lo) / 2;
+                    if (keys[m] & mask) {
+                        hi = m;
+                    } else {
+                        lo = m + 1;
+                    }
+                }
+                mid = lo;
+                if (mid != begin && mid != end) {
+                    break;
+                }
+            }
+
+            if (bit < 0) {
+                // Same cell all along, only duplicates left.
+                return build(begin, end, depth);
+            }
+
+            // The last cell of the lower half of the key range and the first
+            // cell of the upper half are neighbors on the curve, they differ
+            // by one on the separating axis.
+            const std::uint64_t boundary = ((keys[begin] >> bit >> 1 << 1) | 1) << bit;
+            std::uint32_t before[dimension];
+            std::uint32_t after[dimension];
+            util::hilbert_coords(boundary - 1, dimension, state.bits, before);
+            util::hilbert_coords(boundary, dimension, state.bits, after);
+
+            std::size_t axis = 0;
+            while (axis + 1 < dimension && before[axis] == after[axis]) {
+                axis++;
+            }
+
+            size_t split;
+            size_t lower_begin, lower_end, upper_begin, upper_end;
+            if (after[axis] > before[axis]) {
+                // Keys above the boundary are the upper side.
+                split = closest_to_plane(mid, end, axis, state);
+                rotate(mid, split, split + 1, state);
+                split = mid;
+                lower_begin = begin;
+                lower_end = mid;
+                upper_begin = mid + 1;
+                upper_end = end;
+            } else {
+                split = closest_to_plane(begin, mid, axis, state);
+                rotate(split, split + 1, mid, state);
+                split = mid - 1;
+                lower_begin = mid;
+                lower_end = end;
+                upper_begin = begin;
+                upper_end = mid - 1;
+            }
+
+            node_index left = build_hilbert(lower_begin, lower_end, bit - 1,
+                                            state, depth + 1);
+            node_index right = build_hilbert(upper_begin, upper_end, bit - 1,
+                                             state, depth + 1);
+
+            kdnode &node = m_nodes[split];
+            node.axis = static_cast<int>(axis);
+            node.left = left;
+            node.right = right;
+
+            return static_cast<node_index>(split);
+        }
+
+        // Entry of m_nodes[begin, end) with the smallest coordinate on axis.
+        static size_t closest_to_plane(size_t begin, size_t end, std::size_t axis,
+                                       const HilbertBuild &state) {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const double *coords = &state.coords[axis];
+            size_t best = begin;
+            for (size_t i = begin + 1; i < end; i++) {
+                if (coords[i * dimension] < coords[best * dimension]) {
+                    best = i;
+                }
+            }
+            return best;
+        }
+
+        // std::rotate applied to the entries and their keys and coordinates.
+        void rotate(size_t first, size_t middle, size_t last, HilbertBuild &state) {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            std::rotate(m_nodes.begin() + first, m_nodes.begin() + middle,
+                        m_nodes.begin() + last);
+            std::rotate(state.keys.begin() + first, state.keys.begin() + middle,
+                        state.keys.begin() + last);
+            std::rotate(state.coords.begin() + first * dimension,
+                        state.coords.begin() + middle * dimension,
+                        state.coords.begin() + last * dimension);
+        }
+
+        // Per axis lists of entry indices, sorted by coordinate then index so
+        // that duplicates are ordered too. Coordinates are copied next to
+        // each other for the comparisons.
+        struct PresortedBuild {
+            std::vector<node_index> sorted[boost::geometry::dimension<Point>::value];
+            std::vector<node_index> scratch;
+            std::vector<double> coords;
+
+            bool less(std::size_t axis, node_index a, node_index b) const {
+                const std::size_t dimension = boost::geometry::dimension<Point>::value;
+                double ca = coords[a * dimension + axis];
+                double cb = coords[b * dimension + axis];
+                return ca < cb || (ca == cb && a < b);
+            }
+        };
+
+        struct PresortedRange {
+            const PresortedBuild &state;
+            size_t begin;
+            size_t end;
+            const Cell &cell;
+            int level;
+
+            PresortedRange(const PresortedBuild &s, size_t b, size_t e,
+                           const Cell &c, int d)
+                : state(s), begin(b), end(e), cell(c), level(d) {}
+
+            size_t size() const { return end - begin; }
+            std::size_t dimension() const { return boost::geometry::dimension<Point>::value; }
+            int depth() const { return level; }
+            double lower(std::size_t axis) const { return cell.lower[axis]; }
+            double upper(std::size_t axis) const { return cell.upper[axis]; }
+            double coordinate(size_t i, std::size_t axis) const {
+                return state.coords[state.sorted[0][begin + i] * dimension() + axis];
+            }
+        };
+
+        struct PresortedLess {
+            const PresortedBuild *state;
+            std::size_t axis;
+            PresortedLess(const PresortedBuild *s, std::size_t a) : state(s), axis(a) {}
+            bool operator()(node_index a, node_index b) const {
+                return state->less(axis, a, b);
+            }
+        };
+
+        node_index build_presorted() {
+
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const size_t size = m_nodes.size();
+
+            PresortedBuild state;
+            state.coords.resize(size * dimension);
+            for (size_t i = 0; i < size; i++) {
+                for (std::size_t a = 0; a < dimension; a++) {
+                    state.coords[i * dimension + a] = util::get(*m_nodes[i].split, a);
+                }
+            }
+            for (std::size_t a = 0; a < dimension; a++) {
+                std::vector<node_index> &sorted = state.sorted[a];
+                sorted.resize(size);
+                for (size_t i = 0; i < size; i++) {
+                    sorted[i] = static_cast<node_index>(i);
+                }
+                std::sort(sorted.begin(), sorted.end(), PresortedLess(&state, a));
+            }
+            state.scratch.resize(size);
+
+            Cell cell;
+            bounds(0, size, cell);
+
+            // The entries end up at the same position as with
+            // build(begin, end, depth).
+            Nodes nodes(m_nodes);
+            node_index root = build_presorted(0, size, 0, cell, state, nodes);
+            m_nodes.swap(nodes);
+            return root;
+        }
+
+        // All the lists hold the entries of the subtree in [begin, end).
+        node_index build_presorted(size_t begin, size_t end, int depth,
+                                   const Cell &cell, PresortedBuild &state,
+                                   Nodes &nodes) const {
+
+            if (begin == end) {
+                return npos;
+            }
+
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+
+            split_plan plan = Split::choose(PresortedRange(state, begin, end, cell, depth));
+            const std::size_t axis = plan.axis;
+            const std::vector<node_index> &sorted_axis = state.sorted[axis];
+
+            size_t median;
+            if (plan.at_median) {
+                median = begin + (end - begin) / 2;
+            } else {
+                // First entry not below the plane, or the last one.
+                size_t lo = begin, hi = end;
+                while (lo < hi) {
+                    size_t m = lo + (hi - lo) / 2;
+                    if (state.coords[sorted_axis[m] * dimension + axis] < plan.value) {
+                        lo = m + 1;
+                    } else {
+                        hi = m;
+                    }
+                }
+                median = std::min(lo, end - 1);
+            }
+            const node_index entry = sorted_axis[median];
+
+            // Split the other lists around the median entry, keeping them
+            // sorted. The lower part has exactly median - begin entries.
+            for (std::size_t a = 0; a < dimension; a++) {
+                if (a == axis) {
+                    continue;
+                }
+                std::vector<node_index> &sorted = state.sorted[a];
+                size_t lower = begin;
+                size_t upper = 0;
+                for (size_t i = begin; i < end; i++) {
+                    node_index current = sorted[i];
+                    if (current == entry) {
+                        continue;
+                    }
+                    if (state.less(axis, current, entry)) {
+                        sorted[lower++] = current;
+                    } else {
+                        state.scratch[upper++] = current;
+                    }
+                }
+                std::copy(state.scratch.begin(), state.scratch.begin() + upper,
+                          sorted.begin() + median + 1);
+            }
+
+            const double value = state.coords[entry * dimension + axis];
+            Cell lower = cell;
+            lower.upper[axis] = value;
+            Cell upper = cell;
+            upper.lower[axis] = value;
+
+            node_index left = build_presorted(begin, median, depth + 1, lower, state, nodes);
+            node_index right = build_presorted(median + 1, end, depth + 1, upper, state, nodes);
+
+            kdnode &node = nodes[median];
+            node = m_nodes[entry];
+            node.axis = static_cast<int>(axis);
+            node.left = left;
+            node.right = right;
+
+            return static_cast<node_index>(median);
+        }
+
+        // Lower bound on the distance from query to the entries below node,
+        // lying beyond a split plane at distance dx along axis.
+        double lower_bound(const Point &query, node_ptr node, double dx, int axis) const {
+            return m_boxes.empty() ? plane_distance(query, dx, axis)
+                                   : box_distance(query, node);
+        }
+
+        // Distance from query to everything across a split plane at dx.
+        double plane_distance(const Point &query, double dx, int axis) const {
+            return m_metric.plane(
+                m_metric.split_gap(dx, util::get(query, axis), axis), axis);
+        }
+
+        double box_distance(const Point &query, node_ptr node) const {
+            return cell_distance(query, m_boxes[node - &m_nodes[0]]);
+        }
+
+        template <typename Box>
+        double cell_distance(const Point &query, const Box &box) const {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            double distance = 0;
+            for (std::size_t a = 0; a < dimension; a++) {
+                double d = m_metric.gap(util::get(query, a), box.lower[a],
+                                        box.upper[a], a);
+                distance = m_metric.combine(distance, m_metric.plane(d, a));
+            }
+            return distance;
+        }
+
+        // Distance between two boxes.
+        template <typename Box>
+        double cells_distance(const Box &a, const Cell &b) const {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            double distance = 0;
+            for (std::size_t i = 0; i < dimension; i++) {
+                double d = m_metric.gap(a.lower[i], a.upper[i], b.lower[i],
+                                        b.upper[i], i);
+                distance = m_metric.combine(distance, m_metric.plane(d, i));
+            }
+            return distance;
+        }
+
+        void update_boxes() {
+            if (!m_bounding_boxes || m_root == npos) {
+                m_boxes.clear();
+                return;
+            }
+            m_boxes.resize(m_nodes.size());
+            update_box(m_root, m_boxes);
+        }
+
+        // The stored boxes, or else the same computed into scratch.
+        const std::vector<Cell> &subtree_boxes(std::vector<Cell> &scratch) const {
+            if (!m_boxes.empty() || m_root == npos) {
+                return m_boxes;
+            }
+            scratch.resize(m_nodes.size());
+            update_box(m_root, scratch);
+            return scratch;
+        }
+
+        const Cell &update_box(node_index index, std::vector<Cell> &boxes) const {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const kdnode &node = m_nodes[index];
+            Cell &box = boxes[index];
+            for (std::size_t a = 0; a < dimension; a++) {
+                box.lower[a] = box.upper[a] = util::get(*node.split, a);
+            }
+            const node_index children[2] = { node.left, node.right };
+            for (int c = 0; c < 2; c++) {
+                if (children[c] == npos) {
+                    continue;
+                }
+                const Cell &child = update_box(children[c], boxes);
+                for (std::size_t a = 0; a < dimension; a++) {
+                    box.lower[a] = std::min(box.lower[a], child.lower[a]);
+                    box.upper[a] = std::max(box.upper[a], child.upper[a]);
+                }
+            }
+            return box;
+        }
+
+        node_ptr node_at(node_index index) const {
+            return index == npos ? NULL : &m_nodes[index];
+        }
+
+        static query_result make_result(const node_ptr &node, double distance) {
+            return query_result(node->data, node->split, distance);
+        }
+
+        size_t height(node_index index) const {
+            if (index == npos) {
+                return 0;
+            }
+            const kdnode &node = m_nodes[index];
+            return 1 + std::max(height(node.left), height(node.right));
+        }
+
+        void sum_depths(node_index index, size_t depth, size_t &count,
+                        size_t &sum) const {
+            if (index == npos) {
+                return;
+            }
+            count++;
+            sum += depth;
+            sum_depths(m_nodes[index].left, depth + 1, count, sum);
+            sum_depths(m_nodes[index].right, depth + 1, count, sum);
+        }
+
+        void in_order_layout(node_index index, std::vector<node_index> &order) const {
+            if (index == npos) {
+                return;
+            }
+            in_order_layout(m_nodes[index].left, order);
+            order.push_back(index);
+            in_order_layout(m_nodes[index].right, order);
+        }
+
+        void depth_first_layout(node_index index, std::vector<node_index> &order) const {
+            if (index == npos) {
+                return;
+            }
+            order.push_back(index);
+            depth_first_layout(m_nodes[index].left, order);
+            depth_first_layout(m_nodes[index].right, order);
+        }
+
+        void breadth_first_layout(std::vector<node_index> &order) const {
+            order.push_back(m_root);
+            for (size_t i = 0; i < order.size(); i++) {
+                const kdnode &node = m_nodes[order[i]];
+                if (node.left != npos) order.push_back(node.left);
+                if (node.right != npos) order.push_back(node.right);
+            }
+        }
+
+        // Lays out the top height / 2 levels below index recursively, then
+        // each of the subtrees hanging below them.
+        void van_emde_boas_layout(node_index index, size_t height,
+                                  std::vector<node_index> &order) const {
+            if (index == npos) {
+                return;
+            }
+            if (height == 1) {
+                order.push_back(index);
+                return;
+            }
+
+            size_t top = height / 2;
+            van_emde_boas_layout(index, top, order);
+
+            std::vector<node_index> bottom;
+            nodes_at_depth(index, top, bottom);
+            for (size_t i = 0; i < bottom.size(); i++) {
+                van_emde_boas_layout(bottom[i], height - top, order);
+            }
+        }
+
+        void nodes_at_depth(node_index index, size_t depth,
+                            std::vector<node_index> &result) const {
+            if (index == npos) {
+                return;
+            }
+            if (depth == 0) {
+                result.push_back(index);
+                return;
+            }
+            nodes_at_depth(m_nodes[index].left, depth - 1, result);
+            nodes_at_depth(m_nodes[index].right, depth - 1, result);
+        }
+
+        // Moves m_nodes[order[i]] to position i and rewires the children.
+        // Nodes added since the last build() keep their relative order at
+        // the end.
+        void permute(std::vector<node_index> &order) {
+
+            std::vector<node_index> position(m_nodes.size(), npos);
+            for (size_t i = 0; i < order.size(); i++) {
+                position[order[i]] = static_cast<node_index>(i);
+            }
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                if (position[i] == npos) {
+                    position[i] = static_cast<node_index>(order.size());
+                    order.push_back(static_cast<node_index>(i));
+                }
+            }
+
+            Nodes nodes;
+            nodes.reserve(m_nodes.size());
+            for (size_t i = 0; i < order.size(); i++) {
+                kdnode node = m_nodes[order[i]];
+                if (node.left != npos) node.left = position[node.left];
+                if (node.right != npos) node.right = position[node.right];
+                nodes.push_back(node);
+            }
+
+            m_nodes.swap(nodes);
+            m_root = position[m_root];
+        }
+
+        // Upper bound on the distance from query to anything in box.
+        template <typename Box>
+        double far_distance(const Point &query, const Box &box) const {
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            double distance = 0;
+            for (std::size_t a = 0; a < dimension; a++) {
+                double d = m_metric.far_gap(util::get(query, a), box.lower[a],
+                                            box.upper[a], a);
+                distance = m_metric.combine(distance, m_metric.plane(d, a));
+            }
+            return distance;
+        }
+
+        // Carries the cell of the node down from the root bounds, but uses
+        // the bounding boxes instead when they are kept.
+        template <typename PriorityQueue>
+        void kfarthest(const Point &query, node_index index, const Cell &cell,
+                       size_t k, PriorityQueue &result) const {
+
+            const kdnode &node = m_nodes[index];
+
+            double d = m_metric.distance(query, *node.split);
+            if (result.size() < k || d >= result.top().first) {
+                result.push(DistanceTuple(d, &node));
+                if (result.size() > k) {
+                    result.pop();
+                }
+            }
+
+            const double split = util::get(*node.split, node.axis);
+            Cell cells[2] = { cell, cell };
+            cells[0].upper[node.axis] = split;
+            cells[1].lower[node.axis] = split;
+
+            const node_index children[2] = { node.left, node.right };
+            double bounds[2] = { 0, 0 };
+            for (int c = 0; c < 2; c++) {
+                if (children[c] != npos) {
+                    bounds[c] = m_boxes.empty() ? far_distance(query, cells[c])
+                                                : far_distance(query, m_boxes[children[c]]);
+                }
+            }
+
+            const int first = bounds[1] > bounds[0] ? 1 : 0;
+            for (int i = 0; i < 2; i++) {
+                const int c = i == 0 ? first : 1 - first;
+                if (children[c] == npos ||
+                    (result.size() == k && bounds[c] <= result.top().first)) {
+                    continue;
+                }
+                kfarthest(query, children[c], cells[c], k, result);
+            }
         }
 
+        template <typename Geometry>
+        void knearest_to(const Geometry &geometry, size_t k,
+                         std::vector<query_result> &result,
+                         query_context &context) const {
 
-        // Recursive and iterative methods.
-        const Data *nearest_recursive(const Point &query) const {
+            result.clear();
 
-            if (!m_root) {
-                return NULL;
+            if (m_root == npos || k < 1) {
+                return;
             }
 
-            best_match best(m_root, std::numeric_limits<double>::max());
-
-            nearest(query, m_root, best);
+            MaxPriorityQueue priority_queue(context.m_heap);
+            std::vector<CellTuple> &branches = context.m_cells;
+            branches.clear();
 
-            return best.node->data;
-        }
+            CellTuple root = { 0, node_at(m_root), m_extent };
+            branches.push_back(root);
 
-        void knearest(const Point &query, size_t k, std::vector<const Data*> &result) const {
+            while (!branches.empty()) {
 
-            if (!m_root || k < 1) {
-                return;
-            }
+                if (priority_queue.size() == k &&
+                    branches.front().distance >= priority_queue.top().first) {
+                    break;
+                }
 
-            MaxPriorityQueue priority_queue;
+                std::pop_heap(branches.begin(), branches.end(), NearestCellOnTop());
+                const CellTuple current = branches.back();
+                branches.pop_back();
+
+                node_ptr node = current.node;
+                context.m_visited++;
+                double d = boost::geometry::comparable_distance(*node->split, geometry);
+                if (priority_queue.size() < k || d <= priority_queue.top().first) {
+                    priority_queue.push(DistanceTuple(d, node));
+                    if (priority_queue.size() > k) {
+                        priority_queue.pop();
+                    }
+                }
 
-            knearest(query, m_root, k, priority_queue);
+                const double split = util::get(*node->split, node->axis);
+                const node_index children[2] = { node->left, node->right };
+                for (int c = 0; c < 2; c++) {
+                    if (children[c] == npos) {
+                        continue;
+                    }
+                    CellTuple child = { 0, node_at(children[c]), current.cell };
+                    if (c == 0) {
+                        child.cell.upper[node->axis] = split;
+                    } else {
+                        child.cell.lower[node->axis] = split;
+                    }
+
+                    const Cell &box = m_boxes.empty() ? child.cell : m_boxes[children[c]];
+                    boost::geometry::model::box<Point> region;
+                    for (std::size_t a = 0; a < boost::geometry::dimension<Point>::value; a++) {
+                        util::set(region.min_corner(), a, box.lower[a]);
+                        util::set(region.max_corner(), a, box.upper[a]);
+                    }
+                    child.distance = boost::geometry::comparable_distance(geometry, region);
+
+                    if (priority_queue.size() < k || child.distance < priority_queue.top().first) {
+                        branches.push_back(child);
+                        std::push_heap(branches.begin(), branches.end(), NearestCellOnTop());
+                    }
+                }
+            }
 
             size_t size = priority_queue.size();
 
@@ -101,147 +2700,369 @@ class kdtree {
 
             for (size_t i = 0; i < size; i++) {
                 // Reverse order
-                result[size - i - 1] = priority_queue.top().second->data;
+                const DistanceTuple &top = priority_queue.top();
+                result[size - i - 1] = make_result(top.second, from_euclidean(top.first));
                 priority_queue.pop();
             }
         }
 
-
-        const Data *nearest_iterative(const Point &query) const {
-            if (!m_root) {
-                return NULL;
+        // Comparable of the Metric for a squared Euclidean distance.
+        static double from_euclidean(double squared) {
+            if (std::is_same<Metric, euclidean_metric>::value) {
+                return squared;
             }
+            return Metric::to_comparable(std::sqrt(squared));
+        }
 
-            MinPriorityQueue priority_queue;
+        template <typename Polygon>
+        void query_within(const Polygon &polygon, const Cell &envelope,
+                          node_index index, const Cell &cell,
+                          std::vector<query_result> &result) const {
 
-            best_match best(m_root, std::numeric_limits<double>::max());
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const Cell &box = m_boxes.empty() ? cell : m_boxes[index];
 
-            priority_queue.push(DistanceTuple(0, m_root));
+            bool degenerate = false;
+            for (std::size_t a = 0; a < dimension; a++) {
+                if (box.upper[a] < envelope.lower[a] || envelope.upper[a] < box.lower[a]) {
+                    return;
+                }
+                degenerate = degenerate || box.lower[a] == box.upper[a];
+            }
 
-            while (!priority_queue.empty()) {
+            // Flat boxes trip up the areal algorithms, their entries are
+            // tested instead.
+            if (!degenerate) {
+                boost::geometry::model::box<Point> region;
+                for (std::size_t a = 0; a < dimension; a++) {
+                    util::set(region.min_corner(), a, box.lower[a]);
+                    util::set(region.max_corner(), a, box.upper[a]);
+                }
+                if (boost::geometry::disjoint(region, polygon)) {
+                    return;
+                }
+                // No box / polygon covered_by in boost::geometry, a ring will
+                // do.
+                boost::geometry::model::ring<Point> outline;
+                boost::geometry::convert(region, outline);
+                if (boost::geometry::covered_by(outline, polygon)) {
+                    report_subtree(index, result);
+                    return;
+                }
+            }
 
-                const auto current = priority_queue.top();
+            const kdnode &node = m_nodes[index];
+            if (boost::geometry::covered_by(*node.split, polygon)) {
+                result.push_back(make_result(&node, 0));
+            }
 
-                if (current.first >= best.distance) {
-                    return best.node->data;
-                }
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != npos) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                query_within(polygon, envelope, node.left, lower, result);
+            }
+            if (node.right != npos) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                query_within(polygon, envelope, node.right, upper, result);
+            }
+        }
 
-                priority_queue.pop();
+        void report_subtree(node_index index, std::vector<query_result> &result) const {
+            const kdnode &node = m_nodes[index];
+            result.push_back(make_result(&node, 0));
+            if (node.left != npos) {
+                report_subtree(node.left, result);
+            }
+            if (node.right != npos) {
+                report_subtree(node.right, result);
+            }
+        }
 
-                auto currentNode = current.second;
-                double d = boost::geometry::comparable_distance(
-                    query, *currentNode->split); // no square root
-                double dx = util::subtract(query, *currentNode->split,
-                                           currentNode->axis);
+        void update_aggregates() {
+            m_aggregates.clear();
+            if (m_root == npos) {
+                m_counts.clear();
+                return;
+            }
+            m_counts.resize(m_nodes.size());
+            if (!std::is_same<Aggregate, no_aggregate>::value) {
+                m_aggregates.resize(m_nodes.size());
+            }
+            update_aggregate(m_root);
+        }
 
-                if (d < best.distance) {
-                    best.node = currentNode;
-                    best.distance = d;
+        void update_aggregate(node_index index) {
+            const kdnode &node = m_nodes[index];
+            node_index count = 1;
+            const node_index children[2] = { node.left, node.right };
+            for (int c = 0; c < 2; c++) {
+                if (children[c] != npos) {
+                    update_aggregate(children[c]);
+                    count += m_counts[children[c]];
                 }
+            }
+            m_counts[index] = count;
+
+            if (!m_aggregates.empty()) {
+                typename Aggregate::value_type value = m_aggregate.lift(*node.data);
+                for (int c = 0; c < 2; c++) {
+                    if (children[c] != npos) {
+                        value = m_aggregate.combine(value, m_aggregates[children[c]]);
+                    }
+                }
+                m_aggregates[index] = value;
+            }
+        }
 
-                node_ptr near = dx <= 0 ? currentNode->left : currentNode->right;
-                node_ptr far = dx <= 0 ? currentNode->right : currentNode->left;
-
-                if (far)priority_queue.push(DistanceTuple(dx * dx, far));
-                if (near) priority_queue.push(DistanceTuple(0, near));
+        void add_subtree(node_index index, aggregate_result &result) const {
+            result.count += m_counts[index];
+            if (!m_aggregates.empty()) {
+                result.value = m_aggregate.combine(result.value, m_aggregates[index]);
             }
+        }
 
-            return best.node->data;
+        void add_entry(const kdnode &node, aggregate_result &result) const {
+            result.count++;
+            result.value = m_aggregate.combine(result.value, m_aggregate.lift(*node.data));
         }
 
+        void aggregate_box(const Cell &region, node_index index, const Cell &cell,
+                           aggregate_result &result) const {
 
-    private:
-        struct kdnode {
-            typedef std::shared_ptr<kdnode> ptr;
-            ptr left;
-            ptr right;
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const Cell &box = m_boxes.empty() ? cell : m_boxes[index];
 
-            int axis;
+            bool inside = true;
+            for (std::size_t a = 0; a < dimension; a++) {
+                if (box.upper[a] < region.lower[a] || region.upper[a] < box.lower[a]) {
+                    return;
+                }
+                inside = inside && region.lower[a] <= box.lower[a] &&
+                         box.upper[a] <= region.upper[a];
+            }
+            if (inside) {
+                add_subtree(index, result);
+                return;
+            }
 
-            const Point *split;
-            const Data *data;
+            const kdnode &node = m_nodes[index];
+            bool contained = true;
+            for (std::size_t a = 0; a < dimension && contained; a++) {
+                double v = util::get(*node.split, a);
+                contained = region.lower[a] <= v && v <= region.upper[a];
+            }
+            if (contained) {
+                add_entry(node, result);
+            }
 
-            kdnode(const Point *g, const Data *d)
-                : axis(0), split(g), data(d) {}
-        };
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != npos) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                aggregate_box(region, node.left, lower, result);
+            }
+            if (node.right != npos) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                aggregate_box(region, node.right, upper, result);
+            }
+        }
 
-        // Typedef typename
-        typedef typename kdnode::ptr node_ptr;
+        void aggregate_ball(const Point &center, double radius, node_index index,
+                            const Cell &cell, aggregate_result &result) const {
 
-        typedef std::pair<double, node_ptr> Nodes;
-        typedef std::pair<double, node_ptr> DistanceTuple;
+            const Cell &box = m_boxes.empty() ? cell : m_boxes[index];
 
-        struct SmallestOnTop {
-            bool operator()(const DistanceTuple &a, const DistanceTuple &b) const {
-                return a.first > b.first;
+            if (cell_distance(center, box) > radius) {
+                return;
             }
-        };
-        struct LargestOnTop {
-            bool operator()(const DistanceTuple &a, const DistanceTuple &b) const {
-                return a.first < b.first;
+            if (far_distance(center, box) <= radius) {
+                add_subtree(index, result);
+                return;
             }
-        };
 
-        typedef std::priority_queue<DistanceTuple, std::vector<DistanceTuple>,
-                                    SmallestOnTop>
-            MinPriorityQueue;
-        typedef std::priority_queue<DistanceTuple, std::vector<DistanceTuple>,
-                                    LargestOnTop>
-            MaxPriorityQueue;
+            const kdnode &node = m_nodes[index];
+            if (m_metric.distance(center, *node.split) <= radius) {
+                add_entry(node, result);
+            }
 
-        Nodes m_nodes;
-        node_ptr m_root;
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != npos) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                aggregate_ball(center, radius, node.left, lower, result);
+            }
+            if (node.right != npos) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                aggregate_ball(center, radius, node.right, upper, result);
+            }
+        }
 
+        void update_reverse_bounds() {
+            if (m_reverse_radii.empty() || m_root == npos) {
+                m_reverse_bounds.clear();
+                return;
+            }
+            m_reverse_bounds.resize(m_nodes.size());
+            update_reverse_bound(m_root);
+        }
 
-        template<typename NODE_TYPE>
-        struct Sort : std::binary_function<NODE_TYPE, NODE_TYPE, bool> {
+        double update_reverse_bound(node_index index) {
+            const kdnode &node = m_nodes[index];
+            double bound = m_reverse_radii[node.entry];
+            if (node.left != npos) {
+                bound = std::max(bound, update_reverse_bound(node.left));
+            }
+            if (node.right != npos) {
+                bound = std::max(bound, update_reverse_bound(node.right));
+            }
+            m_reverse_bounds[index] = bound;
+            return bound;
+        }
 
-            Sort(std::size_t dimension) : m_dimension(dimension) {}
+        void reverse_knearest(const Point &query, node_index index, const Cell &cell,
+                              std::vector<query_result> &result) const {
 
-            bool operator()(const NODE_TYPE &lhs, const NODE_TYPE &rhs) const {
-                return util::subtract(*lhs->split, *rhs->split, m_dimension) < 0;
+            const Cell &box = m_boxes.empty() ? cell : m_boxes[index];
+            if (cell_distance(query, box) > m_reverse_bounds[index]) {
+                return;
             }
-            std::size_t m_dimension;
-        };
 
-        struct best_match {
-            node_ptr node;
-            double distance;
-            best_match(const node_ptr &n, double d) : node(n), distance(d) {}
+            const kdnode &node = m_nodes[index];
+            const double d = m_metric.distance(query, *node.split);
+            if (d <= m_reverse_radii[node.entry]) {
+                result.push_back(make_result(&node, d));
+            }
+
+            const double split = util::get(*node.split, node.axis);
+            if (node.left != npos) {
+                Cell lower = cell;
+                lower.upper[node.axis] = split;
+                reverse_knearest(query, node.left, lower, result);
+            }
+            if (node.right != npos) {
+                Cell upper = cell;
+                upper.lower[node.axis] = split;
+                reverse_knearest(query, node.right, upper, result);
+            }
+        }
+
+        // State of kernel_density, shared by all the points.
+        struct Density {
+            const std::vector<Cell> &boxes;
+            const std::vector<node_index> &counts;
+            double bandwidth;
+            density_kernel kernel;
+            double tolerance;
         };
 
-        node_ptr build(Nodes &nodes, int depth) {
+        static double kernel_value(const Density &state, double comparable) {
+            const double u = Metric::to_distance(comparable) / state.bandwidth;
+            if (state.kernel == epanechnikov_kernel) {
+                return u < 1 ? 1 - u * u : 0;
+            }
+            return std::exp(-u * u / 2);
+        }
+
+        double density(const Point &query, const Density &state, node_index index) const {
 
-            if (nodes.empty()) {
-                return node_ptr();
+            const Cell &box = state.boxes[index];
+            const double high = kernel_value(state, cell_distance(query, box));
+            if (high == 0) {
+                return 0;
+            }
+            const double low = kernel_value(state, far_distance(query, box));
+            if (high - low <= state.tolerance) {
+                return state.counts[index] * (high + low) / 2;
             }
 
-            int axis = depth % boost::geometry::dimension<Point>();
+            const kdnode &node = m_nodes[index];
+            double sum = kernel_value(state, m_metric.distance(query, *node.split));
+            if (node.left != npos) {
+                sum += density(query, state, node.left);
+            }
+            if (node.right != npos) {
+                sum += density(query, state, node.right);
+            }
+            return sum;
+        }
 
-            size_t median = nodes.size() / 2;
+        // State of farthest_point_sampling: per node, the distance from its
+        // entry to the closest sample and the largest of these below it.
+        struct Sampling {
+            const std::vector<Cell> &boxes;
+            std::vector<double> closest;
+            std::vector<double> largest;
+            node_ptr sample;
+        };
 
-            std::nth_element(nodes.begin(), nodes.begin() + median, nodes.end(),
-                             Sort<node_ptr>(axis));
+        void sample_node(Sampling &state, node_index index) const {
+            double d = m_metric.distance(*state.sample->split, *m_nodes[index].split);
+            if (d < state.closest[index]) {
+                state.closest[index] = d;
+            }
+        }
 
-            node_ptr node = nodes.at(median);
-            node->axis = axis;
+        // Nothing below can get closer to the new sample than it already is
+        // to an older one once the box lies that far away.
+        void sample_subtree(Sampling &state, node_index index) const {
+            if (cell_distance(*state.sample->split, state.boxes[index]) > state.largest[index]) {
+                return;
+            }
+            sample_node(state, index);
+            if (m_nodes[index].left != npos) {
+                sample_subtree(state, m_nodes[index].left);
+            }
+            if (m_nodes[index].right != npos) {
+                sample_subtree(state, m_nodes[index].right);
+            }
+            update_largest(state, index);
+        }
 
-            Nodes left(nodes.begin(), nodes.begin() + median);
-            Nodes right(nodes.begin() + median + 1, nodes.end());
-            node->left = build(left, depth + 1);
-            node->right = build(right, depth + 1);
+        void update_largest(Sampling &state, node_index index) const {
+            const kdnode &node = m_nodes[index];
+            double largest = state.closest[index];
+            if (node.left != npos) {
+                largest = std::max(largest, state.largest[node.left]);
+            }
+            if (node.right != npos) {
+                largest = std::max(largest, state.largest[node.right]);
+            }
+            state.largest[index] = largest;
+        }
 
-            return node;
+        // The node holding the largest distance, npos once all the entries
+        // are samples.
+        node_index farthest_sample(const Sampling &state) const {
+            node_index index = m_root;
+            if (state.largest[index] < 0) {
+                return npos;
+            }
+            while (state.closest[index] != state.largest[index]) {
+                const kdnode &node = m_nodes[index];
+                index = node.left != npos && state.largest[node.left] == state.largest[index]
+                      ? node.left : node.right;
+            }
+            return index;
         }
 
-        static void nearest(const Point &query, const node_ptr *currentNode,
-                            best_match &best) {
+        // The recursive searches track the distance from the query to the
+        // cell of the current node incrementally (Arya and Mount): offsets
+        // holds the per axis distance to the cell and cell_distance their
+        // combination. Going to the far side only changes the offset on the
+        // split axis, which gives a tighter bound than the plane alone.
+        void nearest(const Point &query, const node_ptr &currentNode,
+                     double cell_distance, double *offsets,
+                     best_match &best) const {
 
           if (!currentNode) {
             return;
           }
 
-          double d = boost::geometry::comparable_distance(
+          double d = m_metric.distance(
               query, *currentNode->split); // no square root
           double dx =
               util::subtract(query, *currentNode->split, currentNode->axis);
@@ -251,28 +3072,40 @@ class kdtree {
             best.distance = d;
           }
 
-          node_ptr near = dx <= 0 ? currentNode->left : currentNode->right;
-          node_ptr far = dx <= 0 ? currentNode->right : currentNode->left;
+          node_ptr near = node_at(dx <= 0 ? currentNode->left : currentNode->right);
+          node_ptr far = node_at(dx <= 0 ? currentNode->right : currentNode->left);
+
+          util::prefetch(near);
+          util::prefetch(far);
+
+          nearest(query, near, cell_distance, offsets, best);
 
-          nearest(query, near, best);
+          const int axis = currentNode->axis;
+          const double offset = offsets[axis];
+          const double gap = m_metric.split_gap(dx, util::get(query, axis), axis);
+          const double far_distance = m_metric.replace(
+              cell_distance, m_metric.plane(offset, axis), m_metric.plane(gap, axis));
 
-          if ((dx * dx) >= best.distance) {
+          if (far_distance >= best.distance) {
             return;
           }
 
-          nearest(query, far, best);
+          offsets[axis] = gap;
+          nearest(query, far, far_distance, offsets, best);
+          offsets[axis] = offset;
         }
 
 
         template <typename PriorityQueue>
-        static void knearest(const Point &query, const node_ptr &currentNode,
-                             size_t k, PriorityQueue &result) {
+        void knearest(const Point &query, const node_ptr &currentNode,
+                      double cell_distance, double *offsets,
+                      size_t k, PriorityQueue &result) const {
 
             if (!currentNode) {
                 return;
             }
 
-            double d = boost::geometry::comparable_distance(
+            double d = m_metric.distance(
                 query, *currentNode->split); // no square root
             double dx =
                 util::subtract(query, *currentNode->split, currentNode->axis);
@@ -286,20 +3119,521 @@ class kdtree {
                 }
             }
 
-            node_ptr near = dx <= 0 ? currentNode->left : currentNode->right;
-            node_ptr far = dx <= 0 ? currentNode->right : currentNode->left;
+            node_ptr near = node_at(dx <= 0 ? currentNode->left : currentNode->right);
+            node_ptr far = node_at(dx <= 0 ? currentNode->right : currentNode->left);
 
-            knearest(query, near, k, result);
+            util::prefetch(near);
+            util::prefetch(far);
 
-            if ((dx * dx) >= result.top().first) {
+            knearest(query, near, cell_distance, offsets, k, result);
+
+            const int axis = currentNode->axis;
+            const double offset = offsets[axis];
+            const double gap = m_metric.split_gap(dx, util::get(query, axis), axis);
+            const double far_distance = m_metric.replace(
+                cell_distance, m_metric.plane(offset, axis), m_metric.plane(gap, axis));
+
+            if (result.size() == k && far_distance >= result.top().first) {
+                return;
+            }
+
+            offsets[axis] = gap;
+            knearest(query, far, far_distance, offsets, k, result);
+            offsets[axis] = offset;
+        }
+
+        // Fills context.m_order with the sequence in which the queries are
+        // run, keys are computed on coordinates quantized to the bounding
+        // box of the batch.
+        static void order_queries(const std::vector<Point> &queries,
+                                  query_order order, query_context &context) {
+
+            std::vector<size_t> &sequence = context.m_order;
+            sequence.resize(queries.size());
+
+            if (order == as_given || queries.empty()) {
+                for (size_t i = 0; i < queries.size(); i++) {
+                    sequence[i] = i;
+                }
+                return;
+            }
+
+            const std::size_t dimension = boost::geometry::dimension<Point>::value;
+            const unsigned bits = std::min<unsigned>(32, 64 / dimension);
+            const double cells = std::ldexp(1.0, bits) - 1;
+
+            double low[dimension];
+            double scale[dimension];
+            for (std::size_t a = 0; a < dimension; a++) {
+                double min = util::get(queries[0], a);
+                double max = min;
+                for (size_t i = 1; i < queries.size(); i++) {
+                    double v = util::get(queries[i], a);
+                    min = std::min(min, v);
+                    max = std::max(max, v);
+                }
+                low[a] = min;
+                scale[a] = max > min ? cells / (max - min) : 0;
+            }
+
+            std::vector<std::pair<std::uint64_t, size_t> > &keys = context.m_keys;
+            keys.resize(queries.size());
+
+            std::uint32_t coords[dimension];
+            for (size_t i = 0; i < queries.size(); i++) {
+                for (std::size_t a = 0; a < dimension; a++) {
+                    coords[a] = static_cast<std::uint32_t>(
+                        (util::get(queries[i], a) - low[a]) * scale[a]);
+                }
+                std::uint64_t key = order == morton_order
+                    ? util::morton_key(coords, dimension, bits)
+                    : util::hilbert_key(coords, dimension, bits);
+                keys[i] = std::make_pair(key, i);
+            }
+
+            std::sort(keys.begin(), keys.end());
+
+            for (size_t i = 0; i < keys.size(); i++) {
+                sequence[i] = keys[i].second;
+            }
+        }
+
+        void start_lane(BatchLane &lane, size_t query) const {
+            lane.query = query;
+            lane.current = node_at(m_root);
+            lane.prefetched = false;
+            lane.heap->clear();
+            lane.stack->clear();
+        }
+
+        // Advances a lane by one step, returns false once its query is done.
+        bool step_lane(BatchLane &lane, const Point &query, size_t k) const {
+
+            std::vector<DistanceTuple> &heap = *lane.heap;
+            std::vector<DistanceTuple> &stack = *lane.stack;
+
+            if (!lane.current) {
+                while (!stack.empty()) {
+                    DistanceTuple candidate = stack.back();
+                    stack.pop_back();
+                    if (heap.size() < k || candidate.first < heap.front().first) {
+                        lane.current = candidate.second;
+                        lane.prefetched = false;
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            // The node record was prefetched on the previous step, now ask
+            // for its point and come back once the other lanes had a turn.
+            if (!lane.prefetched) {
+                util::prefetch(lane.current->split);
+                lane.prefetched = true;
+                return true;
+            }
+
+            node_ptr currentNode = lane.current;
+            double d = m_metric.distance(
+                query, *currentNode->split); // no square root
+            double dx = util::subtract(query, *currentNode->split,
+                                       currentNode->axis);
+
+            if (heap.size() < k || d <= heap.front().first) {
+                heap.push_back(DistanceTuple(d, currentNode));
+                std::push_heap(heap.begin(), heap.end(), LargestOnTop());
+                if (heap.size() > k) {
+                    std::pop_heap(heap.begin(), heap.end(), LargestOnTop());
+                    heap.pop_back();
+                }
+            }
+
+            node_ptr far = node_at(dx <= 0 ? currentNode->right : currentNode->left);
+            if (far) {
+                util::prefetch(far);
+                stack.push_back(DistanceTuple(
+                    plane_distance(query, dx, currentNode->axis), far));
+            }
+
+            lane.current = node_at(dx <= 0 ? currentNode->left : currentNode->right);
+            lane.prefetched = false;
+            util::prefetch(lane.current);
+            return true;
+        }
+
+        // One row of knearest_all, seeded from the row of the parent.
+        void join_node(node_index index, node_index parent, size_t k,
+                       std::vector<DistanceTuple> &found,
+                       query_context &context) const {
+
+            node_ptr self = &m_nodes[index];
+            const Point &query = *self->split;
+
+            double radius = std::numeric_limits<double>::infinity();
+            if (parent != npos) {
+                std::vector<DistanceTuple> &seeds = context.m_stack;
+                seeds.clear();
+                seeds.push_back(DistanceTuple(0, &m_nodes[parent]));
+                for (size_t j = 0; j < k && found[parent * k + j].second; j++) {
+                    seeds.push_back(found[parent * k + j]);
+                }
+                std::vector<double> &distances = context.m_distances;
+                distances.clear();
+                for (size_t j = 0; j < seeds.size(); j++) {
+                    if (seeds[j].second != self) {
+                        distances.push_back(m_metric.distance(
+                            query, *seeds[j].second->split));
+                    }
+                }
+                if (distances.size() >= k) {
+                    std::nth_element(distances.begin(), distances.begin() + (k - 1),
+                                     distances.end());
+                    radius = distances[k - 1];
+                }
+            }
+
+            MaxPriorityQueue priority_queue(context.m_heap);
+            DepthFirstStack stack(context.m_stack);
+
+            stack.push(DistanceTuple(0, node_at(m_root)));
+
+            DistanceTuple current;
+            while (!stack.empty()) {
+
+                stack.pop(current);
+
+                double bound = priority_queue.size() == k ? priority_queue.top().first : radius;
+                if (current.first > bound) {
+                    continue;
+                }
+
+                node_ptr currentNode = current.second;
+                while (currentNode) {
+                    double dx = util::subtract(query, *currentNode->split,
+                                               currentNode->axis);
+
+                    if (currentNode != self) {
+                        double d = m_metric.distance(
+                            query, *currentNode->split); // no square root
+                        if (d <= bound) {
+                            priority_queue.push(DistanceTuple(d, currentNode));
+                            if (priority_queue.size() > k) {
+                                priority_queue.pop();
+                            }
+                            if (priority_queue.size() == k) {
+                                bound = priority_queue.top().first;
+                            }
+                        }
+                    }
+
+                    node_ptr far = node_at(dx <= 0 ? currentNode->right : currentNode->left);
+                    if (far) {
+                        double far_bound = lower_bound(query, far, dx, currentNode->axis);
+                        if (far_bound <= bound) {
+                            stack.push(DistanceTuple(far_bound, far));
+                        }
+                    }
+
+                    currentNode = node_at(dx <= 0 ? currentNode->left : currentNode->right);
+
+                    if (currentNode && !m_boxes.empty() &&
+                        box_distance(query, currentNode) > bound) {
+                        break;
+                    }
+                }
+            }
+
+            DistanceTuple *row = &found[index * k];
+            for (size_t j = priority_queue.size(); j-- > 0;) {
+                row[j] = priority_queue.top();
+                priority_queue.pop();
+            }
+        }
+
+        // Top levels of the tree, in breadth first order, down to where
+        // there are enough subtrees to keep the threads busy.
+        void split_top(unsigned threads, std::vector<node_index> &top,
+                       std::vector<node_index> &subtrees,
+                       std::vector<node_index> *parents) const {
+            top.clear();
+            subtrees.assign(1, m_root);
+            while (!subtrees.empty() && subtrees.size() < 8 * size_t(threads)) {
+                std::vector<node_index> next;
+                for (size_t i = 0; i < subtrees.size(); i++) {
+                    const kdnode &node = m_nodes[subtrees[i]];
+                    top.push_back(subtrees[i]);
+                    const node_index children[2] = { node.left, node.right };
+                    for (int c = 0; c < 2; c++) {
+                        if (children[c] == npos) {
+                            continue;
+                        }
+                        if (parents) {
+                            (*parents)[children[c]] = subtrees[i];
+                        }
+                        next.push_back(children[c]);
+                    }
+                }
+                subtrees.swap(next);
+            }
+        }
+
+        struct CloserResult {
+            bool operator()(const query_result &a, const query_result &b) const {
+                return a.comparable_distance < b.comparable_distance;
+            }
+        };
+
+        // Query node and match, as found by one task of a join.
+        typedef std::vector<std::pair<node_index, DistanceTuple> > JoinMatches;
+
+        // State of the joins, Queries being the tree whose entries are
+        // answered. With matches == NULL best holds the nearest entry found
+        // so far for every query node, otherwise everything within the
+        // fixed radius best[q].first goes to matches. bounds[q] is the
+        // farthest the answers below query node q may still lie.
+        template <typename Queries>
+        struct Join {
+            const Queries &queries;
+            const std::vector<typename Queries::Cell> &query_boxes;
+            const std::vector<Cell> &boxes;
+            std::vector<DistanceTuple> &best;
+            std::vector<double> &bounds;
+            JoinMatches *matches;
+        };
+
+        template <typename Queries>
+        void join(const Queries &queries, double bound,
+                  std::vector<DistanceTuple> &best,
+                  std::vector<JoinMatches> *matches,
+                  unsigned threads) const {
+
+            const size_t size = queries.m_nodes.size();
+            best.assign(size, DistanceTuple(bound, node_ptr(NULL)));
+            if (matches) {
+                matches->clear();
+            }
+            if (m_root == npos || queries.m_root == npos) {
+                return;
+            }
+
+            std::vector<Cell> own_boxes;
+            std::vector<typename Queries::Cell> query_boxes;
+            std::vector<double> bounds(size, bound);
+            Join<Queries> state = {
+                queries, queries.subtree_boxes(query_boxes), subtree_boxes(own_boxes),
+                best, bounds, NULL
+            };
+
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+
+            // The entries of the top query nodes alone, then the subtrees
+            // below them.
+            std::vector<node_index> top;
+            std::vector<node_index> subtrees;
+            queries.split_top(threads, top, subtrees, NULL);
+
+            if (matches) {
+                matches->resize(top.size() + subtrees.size());
+            }
+
+            util::parallel_for(top.size() + subtrees.size(), threads, [&](size_t i) {
+                Join<Queries> task = state;
+                if (matches) {
+                    task.matches = &(*matches)[i];
+                }
+                if (i < top.size()) {
+                    join_point(task, top[i], m_root);
+                } else {
+                    join_nodes(task, subtrees[i - top.size()], m_root);
+                }
+            });
+        }
+
+        // All pairs within the subtree below node.
+        void self_join(Join<kdtree> &state, node_index node) const {
+            self_join_node(state, node);
+            if (m_nodes[node].left != npos) {
+                self_join(state, m_nodes[node].left);
+            }
+            if (m_nodes[node].right != npos) {
+                self_join(state, m_nodes[node].right);
+            }
+        }
+
+        // The pairs that go through node: its entry with the entries below
+        // it, and the left subtree with the right one.
+        void self_join_node(Join<kdtree> &state, node_index node) const {
+            const kdnode &current = m_nodes[node];
+            if (current.left != npos) {
+                join_point(state, node, current.left);
+            }
+            if (current.right != npos) {
+                join_point(state, node, current.right);
+            }
+            if (current.left != npos && current.right != npos) {
+                join_nodes(state, current.left, current.right);
+            }
+        }
+
+        // The entry of query node q against the subtree below node.
+        template <typename Queries>
+        void join_point(Join<Queries> &state, node_index q, node_index node) const {
+            const Point &query = *state.queries.m_nodes[q].split;
+            if (cell_distance(query, state.boxes[node]) > state.best[q].first) {
+                return;
+            }
+            join_pair(state, q, node);
+
+            node_index near = m_nodes[node].left;
+            node_index far = m_nodes[node].right;
+            if (near == npos || (far != npos &&
+                cell_distance(query, state.boxes[far]) <
+                cell_distance(query, state.boxes[near]))) {
+                std::swap(near, far);
+            }
+            if (near != npos) {
+                join_point(state, q, near);
+            }
+            if (far != npos) {
+                join_point(state, q, far);
+            }
+        }
+
+        // The subtree below query node q against the entry of node.
+        template <typename Queries>
+        void join_subtree(Join<Queries> &state, node_index q, node_index node) const {
+            const Point &point = *m_nodes[node].split;
+            if (cell_distance(point, state.query_boxes[q]) > state.bounds[q]) {
+                return;
+            }
+            join_pair(state, q, node);
+
+            const typename Queries::kdnode &query = state.queries.m_nodes[q];
+            if (query.left != npos) {
+                join_subtree(state, query.left, node);
+            }
+            if (query.right != npos) {
+                join_subtree(state, query.right, node);
+            }
+            update_bound(state, q);
+        }
+
+        // The subtree below query node q against the subtree below node:
+        // the entry of q against the subtree, then the subtrees of the
+        // children of q against the entry and the children of node, the
+        // closer child first.
+        template <typename Queries>
+        void join_nodes(Join<Queries> &state, node_index q, node_index node) const {
+            if (cells_distance(state.query_boxes[q], state.boxes[node]) > state.bounds[q]) {
                 return;
             }
+            join_point(state, q, node);
+
+            const typename Queries::kdnode &query = state.queries.m_nodes[q];
+            const node_index children[2] = { query.left, query.right };
+            for (int c = 0; c < 2; c++) {
+                const node_index child = children[c];
+                if (child == npos) {
+                    continue;
+                }
+                join_subtree(state, child, node);
+
+                node_index near = m_nodes[node].left;
+                node_index far = m_nodes[node].right;
+                if (near == npos || (far != npos &&
+                    cells_distance(state.query_boxes[child], state.boxes[far]) <
+                    cells_distance(state.query_boxes[child], state.boxes[near]))) {
+                    std::swap(near, far);
+                }
+                if (near != npos) {
+                    join_nodes(state, child, near);
+                }
+                if (far != npos) {
+                    join_nodes(state, child, far);
+                }
+            }
+            update_bound(state, q);
+        }
+
+        template <typename Queries>
+        void join_pair(Join<Queries> &state, node_index q, node_index node) const {
+            double d = m_metric.distance(
+                *state.queries.m_nodes[q].split, *m_nodes[node].split);
+            if (state.matches) {
+                if (d <= state.best[q].first) {
+                    state.matches->push_back(
+                        std::make_pair(q, DistanceTuple(d, &m_nodes[node])));
+                }
+            } else if (d < state.best[q].first) {
+                state.best[q] = DistanceTuple(d, &m_nodes[node]);
+            }
+        }
 
-            knearest(query, far, k, result);
+        template <typename Queries>
+        static void update_bound(Join<Queries> &state, node_index q) {
+            if (state.matches) {
+                return; // fixed radius
+            }
+            const typename Queries::kdnode &query = state.queries.m_nodes[q];
+            double bound = state.best[q].first;
+            if (query.left != npos) {
+                bound = std::max(bound, state.bounds[query.left]);
+            }
+            if (query.right != npos) {
+                bound = std::max(bound, state.bounds[query.right]);
+            }
+            state.bounds[q] = bound;
         }
 
+        // Fixed size stack for the depth-first traversal. A balanced tree of
+        // 2^32 entries never needs more than 32 slots; deeper (degenerate)
+        // trees spill over into the vector owned by the query_context.
+        class DepthFirstStack {
+            public:
+                explicit DepthFirstStack(std::vector<DistanceTuple> &overflow)
+                    : m_size(0), m_overflow(overflow) {
+                    m_overflow.clear();
+                }
+
+                bool empty() const { return m_size == 0 && m_overflow.empty(); }
+
+                void push(const DistanceTuple &value) {
+                    if (m_size < Capacity) {
+                        m_fixed[m_size++] = value;
+                    } else {
+                        m_overflow.push_back(value);
+                    }
+                }
+
+                void pop(DistanceTuple &value) {
+                    if (!m_overflow.empty()) {
+                        value = m_overflow.back();
+                        m_overflow.pop_back();
+                    } else {
+                        value = m_fixed[--m_size];
+                    }
+                }
+
+            private:
+                static const size_t Capacity = 64;
+                DistanceTuple m_fixed[Capacity];
+                size_t m_size;
+                std::vector<DistanceTuple> &m_overflow;
+        };
+
 }; // class kdtree
 
+template <typename Data, typename Point, typename Split, typename Metric,
+          typename Aggregate>
+const typename kdtree<Data, Point, Split, Metric, Aggregate>::node_index
+    kdtree<Data, Point, Split, Metric, Aggregate>::npos;
+
+template <typename Data, typename Point, typename Split, typename Metric,
+          typename Aggregate>
+const size_t kdtree<Data, Point, Split, Metric, Aggregate>::BatchGroup;
+
 
 } // namespace spatial_index
 
@@ -0,0 +1,120 @@
+#ifndef KMEANS_H_
+#define KMEANS_H_
+
+#include <kdtree.h>
+
+namespace spatial_index {
+
+// Assignment step of Lloyd's k-means: every point goes to its nearest
+// centroid, found in a kdtree over the centroids instead of by comparing
+// against all k of them. The per cluster sums and counts for the update
+// step are gathered along the way, each thread into its own block, so a
+// pass makes no allocation per point.
+template < typename Point = boost::geometry::model::d2::point_xy<double>,
+          typename Metric = euclidean_metric >
+class kmeans_assignment {
+
+    private:
+        typedef kdtree<size_t, Point, median_split, Metric> tree_type;
+
+        static const std::size_t Dimension = boost::geometry::dimension<Point>::value;
+
+    public:
+
+        explicit kmeans_assignment(const Metric &metric = Metric())
+            : m_tree(metric) {}
+        virtual ~kmeans_assignment() {}
+
+        // Copies the centroids and indexes them, once per iteration.
+        void set_centroids(const std::vector<Point> &centroids) {
+            m_tree.clear();
+            m_centroids = centroids;
+            m_ids.resize(centroids.size());
+            for (size_t c = 0; c < centroids.size(); c++) {
+                m_ids[c] = c;
+                m_tree.add(&m_centroids[c], &m_ids[c]);
+            }
+            m_tree.build();
+        }
+
+        const std::vector<Point> &centroids() const { return m_centroids; }
+
+        // labels[i] is the nearest centroid of points[i], sums[c] and
+        // counts[c] the coordinate sum and number of the points of centroid
+        // c, so the next centroid is sums[c] / counts[c]. Returns the sum of
+        // the comparable distances of the points to their centroids, the
+        // squared error by default. The points are split in contiguous
+        // ranges over the threads, 0 for one per core.
+        double assign(const std::vector<Point> &points, std::vector<size_t> &labels,
+                      std::vector<Point> &sums, std::vector<size_t> &counts,
+                      unsigned threads = 0) const {
+
+            const size_t k = m_centroids.size();
+            labels.assign(points.size(), 0);
+            sums.assign(k, Point());
+            counts.assign(k, 0);
+
+            if (k == 0 || points.empty()) {
+                return 0;
+            }
+
+            if (threads == 0) {
+                threads = std::thread::hardware_concurrency();
+            }
+
+            // A few ranges per thread, each with its own sums in double.
+            const size_t ranges = std::min(points.size(), std::max<size_t>(1, threads * 4));
+            const size_t stride = k * (Dimension + 1);
+            std::vector<double> partial(ranges * stride, 0.0);
+            std::vector<double> errors(ranges, 0.0);
+
+            util::parallel_for(ranges, threads, [&](size_t r) {
+                const size_t begin = points.size() * r / ranges;
+                const size_t end = points.size() * (r + 1) / ranges;
+                double *block = &partial[r * stride];
+                typename tree_type::query_result nearest;
+                double error = 0;
+                for (size_t i = begin; i < end; i++) {
+                    m_tree.nearest_recursive(points[i], nearest);
+                    const size_t c = *nearest.data;
+                    labels[i] = c;
+                    error += nearest.comparable_distance;
+                    double *sum = block + c * (Dimension + 1);
+                    for (std::size_t a = 0; a < Dimension; a++) {
+                        sum[a] += util::get(points[i], a);
+                    }
+                    sum[Dimension] += 1;
+                }
+                errors[r] = error;
+            });
+
+            double error = 0;
+            for (size_t c = 0; c < k; c++) {
+                double sum[Dimension + 1] = {0};
+                for (size_t r = 0; r < ranges; r++) {
+                    const double *block = &partial[r * stride + c * (Dimension + 1)];
+                    for (std::size_t a = 0; a <= Dimension; a++) {
+                        sum[a] += block[a];
+                    }
+                }
+                for (std::size_t a = 0; a < Dimension; a++) {
+                    util::set(sums[c], a, sum[a]);
+                }
+                counts[c] = static_cast<size_t>(sum[Dimension]);
+            }
+            for (size_t r = 0; r < ranges; r++) {
+                error += errors[r];
+            }
+            return error;
+        }
+
+    private:
+        std::vector<Point> m_centroids;
+        std::vector<size_t> m_ids;
+        tree_type m_tree;
+
+}; // class kmeans_assignment
+
+} // namespace spatial_index
+
+#endif /* KMEANS_H_ */
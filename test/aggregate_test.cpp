@@ -0,0 +1,131 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class AggregateTest : public ::testing::Test {};
+
+typedef ::testing::Types<
+    kdtree<int, point2, median_split, euclidean_metric, sum_aggregate<long> >,
+    kdtree<int, point2, max_spread_split, manhattan_metric, min_aggregate<int> >,
+    kdtree<int, point2, sliding_midpoint_split, chebyshev_metric, max_aggregate<int> >,
+    kdtree<int, point2, surface_area_split, weighted_euclidean_metric, sum_aggregate<double> >,
+    kdtree<int, point3, median_split, euclidean_metric, max_aggregate<double> >,
+    kdtree<int, point3, sliding_midpoint_split, manhattan_metric, sum_aggregate<long> >,
+    kdtree<int, point2> > aggregate_types;
+
+TYPED_TEST_SUITE(AggregateTest, aggregate_types);
+
+template <typename Tree> struct policy;
+
+template <typename Data, typename Point, typename Split, typename Metric, typename Aggregate>
+struct policy<kdtree<Data, Point, Split, Metric, Aggregate> > {
+    typedef Aggregate type;
+};
+
+// Count and Aggregate of the selected entries, folded one by one.
+template <typename Aggregate, typename Select>
+std::pair<size_t, typename Aggregate::value_type> fold(const std::vector<int> &data,
+                                                       Select selected) {
+    const Aggregate aggregate;
+    std::pair<size_t, typename Aggregate::value_type> result(0, aggregate.identity());
+    for (size_t i = 0; i < data.size(); i++) {
+        if (selected(i)) {
+            result.first++;
+            result.second = aggregate.combine(result.second, aggregate.lift(data[i]));
+        }
+    }
+    return result;
+}
+
+template <typename Value>
+void expect_value(const Value &expected, const Value &found) {
+    EXPECT_EQ(expected, found);
+}
+
+inline void expect_value(const no_aggregate::value_type &, const no_aggregate::value_type &) {}
+
+inline void expect_value(const double &expected, const double &found) {
+    EXPECT_NEAR(expected, found, 1e-9 * std::fabs(expected));
+}
+
+// Integral coordinates, box corners and radii, so plenty of entries lie on
+// the border, which is inside.
+TYPED_TEST(AggregateTest, MatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    typedef typename policy<Tree>::type Aggregate;
+    typedef boost::geometry::model::box<Point> box;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    const std::size_t dimension = boost::geometry::dimension<Point>::value;
+
+    const std::vector<Point> entries = random_points<Point>(600, 30, true, 141);
+    std::vector<int> data(entries.size());
+    std::mt19937 random(142);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<int>(random() % 2001) - 1000;
+    }
+
+    const std::vector<Point> corners = random_points<Point>(40, 30, true, 143);
+    std::vector<box> boxes;
+    for (size_t i = 0; i + 1 < corners.size(); i += 2) {
+        box b;
+        for (std::size_t a = 0; a < dimension; a++) {
+            const double x = util::get(corners[i], a);
+            const double y = util::get(corners[i + 1], a);
+            util::set(b.min_corner(), a, std::min(x, y));
+            util::set(b.max_corner(), a, std::max(x, y));
+        }
+        boxes.push_back(b);
+    }
+    // All of it, and a single position.
+    box all;
+    for (std::size_t a = 0; a < dimension; a++) {
+        util::set(all.min_corner(), a, -1);
+        util::set(all.max_corner(), a, 30);
+    }
+    boxes.push_back(all);
+    boxes.push_back(box(entries[0], entries[0]));
+
+    const std::vector<Point> centers = random_points<Point>(20, 30, true, 145);
+    const double radii[] = { 0, 3, 8, 100 };
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        for (size_t b = 0; b < boxes.size(); b++) {
+            const std::pair<size_t, typename Aggregate::value_type> expected =
+                fold<Aggregate>(data, [&](size_t i) {
+                    return boost::geometry::covered_by(entries[i], boxes[b]);
+                });
+            const typename Tree::aggregate_result found = tree.aggregate_within(boxes[b]);
+            EXPECT_EQ(expected.first, found.count) << "box " << b;
+            expect_value(expected.second, found.value);
+        }
+        for (size_t c = 0; c < centers.size(); c++) {
+            for (size_t r = 0; r < 4; r++) {
+                const std::pair<size_t, typename Aggregate::value_type> expected =
+                    fold<Aggregate>(data, [&](size_t i) {
+                        return metric.distance(centers[c], entries[i]) <=
+                               traits<Tree>::metric_type::to_comparable(radii[r]);
+                    });
+                const typename Tree::aggregate_result found =
+                    tree.aggregate_within(centers[c], radii[r]);
+                EXPECT_EQ(expected.first, found.count) << "center " << c << " radius " << radii[r];
+                expect_value(expected.second, found.value);
+            }
+        }
+    });
+}
+
+TYPED_TEST(AggregateTest, Empty) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    tree.build();
+    const Point origin = random_points<Point>(1, 1, true, 146)[0];
+    EXPECT_EQ(0u, tree.aggregate_within(boost::geometry::model::box<Point>(origin, origin)).count);
+    EXPECT_EQ(0u, tree.aggregate_within(origin, 10).count);
+}
+
+} // namespace
@@ -0,0 +1,97 @@
+#include <kdtree.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+#include <gtest/gtest.h>
+
+// Counts every allocation of the test binary.
+static std::atomic<size_t> allocations(0);
+
+void *operator new(std::size_t size) {
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+using namespace spatial_index;
+
+typedef boost::geometry::model::d2::point_xy<double> point;
+typedef kdtree<int, point> tree_type;
+
+class AllocTest : public ::testing::Test {
+    protected:
+        void SetUp() {
+            std::mt19937 random(7);
+            std::uniform_real_distribution<double> coordinate(0, 1000);
+            entries.resize(5000);
+            data.resize(entries.size());
+            for (size_t i = 0; i < entries.size(); i++) {
+                entries[i] = point(coordinate(random), coordinate(random));
+                tree.add(&entries[i], &data[i]);
+            }
+            tree.build();
+            queries.resize(200);
+            for (size_t i = 0; i < queries.size(); i++) {
+                queries[i] = point(coordinate(random), coordinate(random));
+            }
+        }
+
+        // Every query API taking a context, twice over the same queries.
+        void run(tree_type::query_context &context) {
+            tree_type::query_result nearest;
+            for (size_t i = 0; i < queries.size(); i++) {
+                tree.knearest(queries[i], 8, results, context);
+                tree.knearest_iterative(queries[i], 8, results, context);
+                tree.nearest_iterative(queries[i], nearest, context);
+            }
+            tree.knearest_batch(queries, 8, batch, context);
+            tree.knearest_batch(queries, 8, batch, context, tree_type::hilbert_order);
+            tree.nearest_batch(queries, batch, context, tree_type::morton_order);
+            tree.knearest_batch(queries, 8, batch, context);
+        }
+
+        std::vector<point> entries;
+        std::vector<int> data;
+        std::vector<point> queries;
+        tree_type tree;
+
+        std::vector<tree_type::query_result> results;
+        std::vector<tree_type::query_result> batch;
+};
+
+TEST_F(AllocTest, WarmContextDoesNotAllocate) {
+    tree_type::query_context context;
+
+    size_t before = allocations;
+    run(context);
+    EXPECT_GT(allocations - before, 0u);
+
+    before = allocations;
+    run(context);
+    EXPECT_EQ(0u, allocations - before);
+}
+
+TEST_F(AllocTest, WarmContextDoesNotAllocateWithBoxes) {
+    tree.set_bounding_boxes(true);
+    tree.build();
+    tree.relayout(tree_type::van_emde_boas);
+    tree_type::query_context context;
+
+    run(context);
+
+    const size_t before = allocations;
+    run(context);
+    EXPECT_EQ(0u, allocations - before);
+}
+
+} // namespace
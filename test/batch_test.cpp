@@ -0,0 +1,97 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class BatchTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(BatchTest, tree_types);
+
+// knearest_batch and nearest_batch in every query order, rows checked
+// against brute force, padding included.
+TYPED_TEST(BatchTest, MatchesBruteForceInEveryOrder) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric =
+        make_metric<typename traits<Tree>::metric_type>();
+
+    for (int integral = 0; integral < 2; integral++) {
+        const std::vector<Point> entries = random_points<Point>(300, 30, integral != 0, 3);
+        const std::vector<Point> queries = random_points<Point>(60, 30, false, 4);
+        const std::vector<int> data = identities(entries.size());
+        const std::vector<std::vector<double> > expected =
+            brute_force(metric, entries, queries);
+
+        for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+            const typename Tree::query_order orders[] = {
+                Tree::as_given, Tree::morton_order, Tree::hilbert_order
+            };
+            typename Tree::query_context context;
+            std::vector<typename Tree::query_result> results;
+
+            for (int o = 0; o < 3; o++) {
+                SCOPED_TRACE(o);
+                const size_t ks[] = { 1, 7 };
+                for (int i = 0; i < 2; i++) {
+                    const size_t k = ks[i];
+                    tree.knearest_batch(queries, k, results, context, orders[o]);
+                    ASSERT_EQ(queries.size() * k, results.size());
+                    for (size_t q = 0; q < queries.size(); q++) {
+                        expect_knearest(metric, entries, queries[q], expected[q], k,
+                                        &results[q * k], k);
+                    }
+                }
+
+                tree.nearest_batch(queries, results, orders[o]);
+                ASSERT_EQ(queries.size(), results.size());
+                for (size_t q = 0; q < queries.size(); q++) {
+                    expect_knearest(metric, entries, queries[q], expected[q], 1, &results[q], 1);
+                }
+            }
+        });
+    }
+}
+
+TYPED_TEST(BatchTest, PadsRowsBeyondTheEntries) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric =
+        make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(5, 10, false, 5);
+    const std::vector<Point> queries = random_points<Point>(20, 10, false, 6);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        std::vector<typename Tree::query_result> results;
+        const size_t k = 8;
+        tree.knearest_batch(queries, k, results, Tree::hilbert_order);
+        ASSERT_EQ(queries.size() * k, results.size());
+        for (size_t q = 0; q < queries.size(); q++) {
+            expect_knearest(metric, entries, queries[q], expected[q], k, &results[q * k],
+                            entries.size());
+            for (size_t j = entries.size(); j < k; j++) {
+                EXPECT_TRUE(results[q * k + j].data == NULL);
+            }
+        }
+    });
+}
+
+TYPED_TEST(BatchTest, EmptyTreeGivesEmptyRows) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    const std::vector<Point> queries = random_points<Point>(3, 10, false, 7);
+    std::vector<typename Tree::query_result> results;
+    tree.knearest_batch(queries, 2, results, Tree::morton_order);
+    ASSERT_EQ(6u, results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+        EXPECT_TRUE(results[i].data == NULL);
+    }
+}
+
+} // namespace
@@ -0,0 +1,87 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class BoxTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(BoxTest, tree_types);
+
+// Builds a tree over entries, with or without boxes.
+template <typename Tree>
+void build(Tree &tree, const std::vector<typename traits<Tree>::point_type> &entries,
+           const std::vector<int> &data, int strategy, bool boxes, bool relayout) {
+    tree.set_bounding_boxes(boxes);
+    for (size_t i = 0; i < entries.size(); i++) {
+        tree.add(&entries[i], &data[i]);
+    }
+    tree.build(static_cast<typename Tree::build_strategy>(strategy));
+    if (relayout) {
+        tree.relayout(Tree::van_emde_boas);
+    }
+}
+
+// Boxes only prune harder: the same answers, and on clustered data no
+// more nodes visited than with the split planes alone.
+TYPED_TEST(BoxTest, SameAnswersFewerVisits) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = clustered_points<Point>(2000, 31);
+    const std::vector<Point> queries = random_points<Point>(50, 1000, false, 32);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    for (int strategy = 0; strategy < 3; strategy++) {
+        for (int relayout = 0; relayout < 2; relayout++) {
+            const configuration c = { strategy, true, relayout != 0 };
+            SCOPED_TRACE(c.describe());
+
+            Tree planes(metric), boxes(metric);
+            build(planes, entries, data, strategy, false, c.relayout);
+            build(boxes, entries, data, strategy, true, c.relayout);
+
+            typename Tree::query_context without, with;
+            std::vector<typename Tree::query_result> results;
+            typename Tree::query_result nearest;
+            for (size_t q = 0; q < queries.size(); q++) {
+                planes.knearest_iterative(queries[q], 5, results, without);
+                boxes.knearest_iterative(queries[q], 5, results, with);
+                expect_knearest(metric, entries, queries[q], expected[q], 5, results);
+
+                planes.nearest_iterative(queries[q], nearest, without);
+                ASSERT_TRUE(boxes.nearest_iterative(queries[q], nearest, with));
+                expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+            }
+            EXPECT_LE(with.nodes_visited(), without.nodes_visited());
+        }
+    }
+}
+
+// Turning boxes off after a build drops them, the queries go back to the
+// split planes.
+TYPED_TEST(BoxTest, DisabledAfterBuild) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(500, 100, true, 33);
+    const std::vector<Point> queries = random_points<Point>(30, 100, false, 34);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    Tree tree(metric);
+    build(tree, entries, data, Tree::median_build, true, false);
+    tree.set_bounding_boxes(false);
+
+    std::vector<typename Tree::query_result> results;
+    for (size_t q = 0; q < queries.size(); q++) {
+        tree.knearest_iterative(queries[q], 3, results);
+        expect_knearest(metric, entries, queries[q], expected[q], 3, results);
+    }
+}
+
+} // namespace
@@ -0,0 +1,146 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class BuildTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(BuildTest, tree_types);
+
+// The single query methods on every build, against brute force.
+TYPED_TEST(BuildTest, QueriesMatchBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric =
+        make_metric<typename traits<Tree>::metric_type>();
+
+    for (int integral = 0; integral < 2; integral++) {
+        const std::vector<Point> entries = random_points<Point>(300, 30, integral != 0, 11);
+        const std::vector<Point> queries = random_points<Point>(40, 30, false, 12);
+        const std::vector<int> data = identities(entries.size());
+        const std::vector<std::vector<double> > expected =
+            brute_force(metric, entries, queries);
+
+        for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+            EXPECT_EQ(entries.size(), tree.statistics().size);
+
+            typename Tree::query_context context;
+            typename Tree::query_result nearest;
+            std::vector<typename Tree::query_result> results;
+            for (size_t q = 0; q < queries.size(); q++) {
+                ASSERT_TRUE(tree.nearest_recursive(queries[q], nearest, context));
+                expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+                ASSERT_TRUE(tree.nearest_iterative(queries[q], nearest, context));
+                expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+
+                tree.knearest(queries[q], 6, results, context);
+                expect_knearest(metric, entries, queries[q], expected[q], 6, results);
+                tree.knearest_iterative(queries[q], 6, results, context);
+                expect_knearest(metric, entries, queries[q], expected[q], 6, results);
+            }
+        });
+    }
+}
+
+TYPED_TEST(BuildTest, ClusteredQueriesMatchBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric =
+        make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = clustered_points<Point>(400, 13);
+    const std::vector<Point> queries = clustered_points<Point>(40, 13);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        typename Tree::query_context context;
+        std::vector<typename Tree::query_result> results;
+        for (size_t q = 0; q < queries.size(); q++) {
+            tree.knearest_iterative(queries[q], 10, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 10, results);
+        }
+    });
+}
+
+// Builds every tree from the entries with median_build, presorted_build
+// and presorted_build again: the first two must have the same shape, the
+// last two the same entries in the same places.
+template <typename Tree>
+void expect_presorted_like_median(const std::vector<typename traits<Tree>::point_type> &entries) {
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric =
+        make_metric<typename traits<Tree>::metric_type>();
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<Point> queries = random_points<Point>(30, 8, false, 15);
+
+    Tree median(metric);
+    Tree presorted(metric);
+    Tree again(metric);
+    for (size_t i = 0; i < entries.size(); i++) {
+        median.add(&entries[i], &data[i]);
+        presorted.add(&entries[i], &data[i]);
+        again.add(&entries[i], &data[i]);
+    }
+    median.build(Tree::median_build);
+    presorted.build(Tree::presorted_build);
+    again.build(Tree::presorted_build);
+
+    const typename Tree::tree_statistics a = median.statistics();
+    const typename Tree::tree_statistics b = presorted.statistics();
+    EXPECT_EQ(a.size, b.size);
+    EXPECT_EQ(a.height, b.height);
+    EXPECT_DOUBLE_EQ(a.mean_depth, b.mean_depth);
+
+    std::vector<typename Tree::query_result> first;
+    std::vector<typename Tree::query_result> second;
+    for (size_t q = 0; q < queries.size(); q++) {
+        presorted.knearest(queries[q], 5, first);
+        again.knearest(queries[q], 5, second);
+        ASSERT_EQ(first.size(), second.size());
+        for (size_t j = 0; j < first.size(); j++) {
+            EXPECT_EQ(first[j].point, second[j].point);
+        }
+    }
+}
+
+// With distinct coordinates the policies see the same entries either way.
+TYPED_TEST(BuildTest, PresortedBuildMatchesMedianShape) {
+    typedef typename traits<TypeParam>::point_type Point;
+    expect_presorted_like_median<TypeParam>(random_points<Point>(1000, 8, false, 14));
+}
+
+// Ties may land on either side, which only a split by counts ignores.
+TEST(PresortedBuildTest, MatchesMedianShapeOnDuplicates) {
+    expect_presorted_like_median<kdtree<int, point2> >(
+        random_points<point2>(1000, 8, true, 16));
+    expect_presorted_like_median<kdtree<int, point3> >(
+        std::vector<point3>(300, point3(1, 2, 3)));
+}
+
+TEST(HilbertBuildTest, KeepsEveryEntryOnDuplicates) {
+    typedef kdtree<int, point2> Tree;
+    const std::vector<point2> entries(100, point2(3, 4));
+    const std::vector<int> data = identities(entries.size());
+
+    Tree tree;
+    for (size_t i = 0; i < entries.size(); i++) {
+        tree.add(&entries[i], &data[i]);
+    }
+    tree.build(Tree::hilbert_build);
+    EXPECT_EQ(entries.size(), tree.statistics().size);
+
+    std::vector<Tree::query_result> results;
+    tree.knearest(point2(0, 0), entries.size(), results);
+    ASSERT_EQ(entries.size(), results.size());
+    std::vector<int> found;
+    for (size_t i = 0; i < results.size(); i++) {
+        found.push_back(*results[i].data);
+    }
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(data, found);
+}
+
+} // namespace
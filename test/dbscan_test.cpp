@@ -0,0 +1,158 @@
+#include "test_util.h"
+
+#include <dbscan.h>
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class DbscanTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(DbscanTest, tree_types);
+
+// Plain O(n^2) DBSCAN: which entries are core, and the cluster of every
+// core entry as the smallest core entry it is connected to.
+template <typename Metric, typename Point>
+void brute_dbscan(const Metric &metric, const std::vector<Point> &entries, double eps,
+                  size_t min_points, std::vector<bool> &core, std::vector<size_t> &component) {
+    const size_t n = entries.size();
+    const double radius = Metric::to_comparable(eps);
+    core.assign(n, false);
+    for (size_t i = 0; i < n; i++) {
+        size_t count = 0;
+        for (size_t j = 0; j < n; j++) {
+            count += metric.distance(entries[i], entries[j]) <= radius ? 1 : 0;
+        }
+        core[i] = count >= min_points;
+    }
+    component.assign(n, n);
+    for (size_t i = 0; i < n; i++) {
+        if (!core[i] || component[i] != n) {
+            continue;
+        }
+        std::vector<size_t> pending(1, i);
+        component[i] = i;
+        while (!pending.empty()) {
+            const size_t a = pending.back();
+            pending.pop_back();
+            for (size_t b = 0; b < n; b++) {
+                if (core[b] && component[b] == n &&
+                    metric.distance(entries[a], entries[b]) <= radius) {
+                    component[b] = i;
+                    pending.push_back(b);
+                }
+            }
+        }
+    }
+}
+
+// Core entries and noise as brute force, core clusters the same partition,
+// every border entry in the cluster of one of its closest core entries,
+// and clusters numbered by their first entry.
+template <typename Tree>
+void expect_clusters(const std::vector<typename traits<Tree>::point_type> &entries,
+                     double eps, size_t min_points) {
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    const std::vector<int> data = identities(entries.size());
+    const size_t n = entries.size();
+    const double radius = traits<Tree>::metric_type::to_comparable(eps);
+
+    std::vector<bool> core;
+    std::vector<size_t> component;
+    brute_dbscan(metric, entries, eps, min_points, core, component);
+
+    // Closest core distance of every other entry, infinite for noise.
+    std::vector<double> closest(n, std::numeric_limits<double>::infinity());
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < n; j++) {
+            const double d = metric.distance(entries[i], entries[j]);
+            if (!core[i] && core[j] && d <= radius) {
+                closest[i] = std::min(closest[i], d);
+            }
+        }
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            dbscan<Tree> clustering(eps, min_points);
+            const size_t clusters = clustering.run(tree, threads);
+            ASSERT_EQ(clusters, clustering.clusters());
+            const std::vector<int> &labels = clustering.labels();
+            ASSERT_EQ(n, labels.size());
+
+            std::vector<int> of_component(n, dbscan<Tree>::noise);
+            int next = 0;
+            for (size_t i = 0; i < n; i++) {
+                EXPECT_EQ(core[i], clustering.is_core(i)) << "entry " << i;
+                if (labels[i] == dbscan<Tree>::noise) {
+                    EXPECT_TRUE(std::isinf(closest[i]) && !core[i]) << "entry " << i;
+                    continue;
+                }
+                // Numbered in order of first appearance.
+                EXPECT_LE(labels[i], next);
+                next = std::max(next, labels[i] + 1);
+
+                if (core[i]) {
+                    int &label = of_component[component[i]];
+                    if (label == dbscan<Tree>::noise) {
+                        label = labels[i];
+                    }
+                    EXPECT_EQ(label, labels[i]) << "core entry " << i;
+                }
+            }
+            EXPECT_EQ(static_cast<int>(clusters), next);
+            // Different components have different labels.
+            std::vector<int> used;
+            for (size_t i = 0; i < n; i++) {
+                if (core[i] && component[i] == i) {
+                    used.push_back(of_component[i]);
+                }
+            }
+            std::sort(used.begin(), used.end());
+            EXPECT_TRUE(std::adjacent_find(used.begin(), used.end()) == used.end());
+            EXPECT_EQ(clusters, used.size());
+
+            for (size_t i = 0; i < n; i++) {
+                if (core[i] || std::isinf(closest[i])) {
+                    continue;
+                }
+                bool found = false;
+                for (size_t j = 0; j < n && !found; j++) {
+                    found = core[j] && labels[j] == labels[i] &&
+                            metric.distance(entries[i], entries[j]) == closest[i];
+                }
+                EXPECT_TRUE(found) << "border entry " << i;
+            }
+        }
+    });
+}
+
+TYPED_TEST(DbscanTest, ClusteredMatchesBruteForce) {
+    typedef typename traits<TypeParam>::point_type Point;
+    std::vector<Point> entries = clustered_points<Point>(400, 161);
+    const std::vector<Point> scattered = random_points<Point>(100, 1000, false, 162);
+    entries.insert(entries.end(), scattered.begin(), scattered.end());
+    expect_clusters<TypeParam>(entries, 2.5, 5);
+    expect_clusters<TypeParam>(entries, 6, 20);
+}
+
+// A grid of duplicates, so that distances equal eps and ties between core
+// entries abound.
+TYPED_TEST(DbscanTest, TiesMatchBruteForce) {
+    typedef typename traits<TypeParam>::point_type Point;
+    const std::vector<Point> entries = random_points<Point>(300, 12, true, 163);
+    expect_clusters<TypeParam>(entries, 1, 3);
+    expect_clusters<TypeParam>(entries, 2, 8);
+}
+
+TYPED_TEST(DbscanTest, Empty) {
+    typedef TypeParam Tree;
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    tree.build();
+    dbscan<Tree> clustering(1, 2);
+    EXPECT_EQ(0u, clustering.run(tree));
+    EXPECT_TRUE(clustering.labels().empty());
+}
+
+} // namespace
@@ -0,0 +1,84 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class DensityTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(DensityTest, tree_types);
+
+// The kernel of kernel_density, summed over every entry.
+template <typename Metric, typename Point>
+std::vector<double> brute_density(const Metric &metric, const std::vector<Point> &entries,
+                                  const std::vector<Point> &points, double bandwidth,
+                                  bool epanechnikov) {
+    std::vector<double> densities(points.size(), 0.0);
+    for (size_t q = 0; q < points.size(); q++) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            const double u = Metric::to_distance(metric.distance(points[q], entries[i])) / bandwidth;
+            densities[q] += epanechnikov ? (u < 1 ? 1 - u * u : 0) : std::exp(-u * u / 2);
+        }
+    }
+    return densities;
+}
+
+// Every entry is off by at most error, so every density by n * error,
+// plus the rounding of summing in another order.
+TYPED_TEST(DensityTest, WithinErrorOfBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = clustered_points<Point>(500, 151);
+    const std::vector<Point> points = random_points<Point>(40, 1000, false, 152);
+    const std::vector<Point> near = clustered_points<Point>(40, 151);
+    std::vector<Point> queries(points);
+    queries.insert(queries.end(), near.begin(), near.end());
+    const std::vector<int> data = identities(entries.size());
+
+    const double bandwidths[] = { 1, 5, 50 };
+    const double errors[] = { 0, 1e-6, 1e-2 };
+    std::vector<std::vector<double> > expected[2];
+    for (int kernel = 0; kernel < 2; kernel++) {
+        for (size_t b = 0; b < 3; b++) {
+            expected[kernel].push_back(
+                brute_density(metric, entries, queries, bandwidths[b], kernel != 0));
+        }
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        std::vector<double> densities;
+        for (int kernel = 0; kernel < 2; kernel++) {
+            for (size_t b = 0; b < 3; b++) {
+                for (size_t e = 0; e < 3; e++) {
+                    SCOPED_TRACE(::testing::Message() << "kernel " << kernel << ", bandwidth "
+                                 << bandwidths[b] << ", error " << errors[e]);
+                    tree.kernel_density(queries, bandwidths[b], densities,
+                                        kernel ? Tree::epanechnikov_kernel : Tree::gaussian_kernel,
+                                        errors[e], 2);
+                    ASSERT_EQ(queries.size(), densities.size());
+                    for (size_t q = 0; q < queries.size(); q++) {
+                        const double tolerance = entries.size() * errors[e] +
+                                                 1e-9 * (1 + expected[kernel][b][q]);
+                        EXPECT_NEAR(expected[kernel][b][q], densities[q], tolerance)
+                            << "point " << q;
+                    }
+                }
+            }
+        }
+    });
+}
+
+TYPED_TEST(DensityTest, Empty) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    tree.build();
+    std::vector<double> densities;
+    tree.kernel_density(std::vector<Point>(3), 1, densities);
+    EXPECT_EQ(std::vector<double>(3, 0.0), densities);
+}
+
+} // namespace
@@ -0,0 +1,124 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class FarthestTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(FarthestTest, tree_types);
+
+// The k farthest found, sorted by decreasing distance, against the end of
+// the brute force distances.
+template <typename Metric, typename Point, typename Result>
+void expect_kfarthest(const Metric &metric, const std::vector<Point> &entries,
+                      const Point &query, const std::vector<double> &expected,
+                      size_t k, const std::vector<Result> &found) {
+    const size_t n = std::min(k, expected.size());
+    ASSERT_EQ(n, found.size());
+    for (size_t j = 0; j < n; j++) {
+        EXPECT_EQ(expected[expected.size() - 1 - j], found[j].comparable_distance)
+            << "farthest " << j;
+        EXPECT_EQ(metric.distance(query, *found[j].point), found[j].comparable_distance);
+        EXPECT_EQ(&entries[*found[j].data], found[j].point);
+    }
+}
+
+TYPED_TEST(FarthestTest, KfarthestMatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    for (int integral = 0; integral < 2; integral++) {
+        const std::vector<Point> entries = random_points<Point>(300, 30, integral != 0, 111);
+        // Queries inside and well outside the entries.
+        const std::vector<Point> queries = random_points<Point>(40, 90, false, 112);
+        const std::vector<int> data = identities(entries.size());
+        const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+        for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+            typename Tree::query_context context;
+            typename Tree::query_result farthest;
+            std::vector<typename Tree::query_result> results;
+            for (size_t q = 0; q < queries.size(); q++) {
+                ASSERT_TRUE(tree.farthest(queries[q], farthest));
+                EXPECT_EQ(expected[q].back(), farthest.comparable_distance);
+                tree.kfarthest(queries[q], 7, results, context);
+                expect_kfarthest(metric, entries, queries[q], expected[q], 7, results);
+            }
+            tree.kfarthest(queries[0], entries.size() + 5, results, context);
+            expect_kfarthest(metric, entries, queries[0], expected[0], entries.size() + 5, results);
+        });
+    }
+}
+
+// Every sample is an entry farthest from the samples before it, whichever
+// one of the ties, and no entry is picked twice.
+template <typename Tree>
+void expect_sampling(const std::vector<typename traits<Tree>::point_type> &entries, size_t m) {
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    const std::vector<int> data = identities(entries.size());
+    const size_t first = entries.size() / 3;
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            std::vector<size_t> samples;
+            tree.farthest_point_sampling(m, samples, first, threads);
+            ASSERT_EQ(std::min(m, entries.size()), samples.size());
+            ASSERT_EQ(first, samples[0]);
+
+            std::vector<double> closest(entries.size(), std::numeric_limits<double>::infinity());
+            std::vector<bool> taken(entries.size(), false);
+            for (size_t s = 0; s < samples.size(); s++) {
+                ASSERT_LT(samples[s], entries.size());
+                ASSERT_FALSE(taken[samples[s]]) << "sample " << s;
+                if (s > 0) {
+                    double largest = -1;
+                    for (size_t i = 0; i < entries.size(); i++) {
+                        if (!taken[i]) {
+                            largest = std::max(largest, closest[i]);
+                        }
+                    }
+                    EXPECT_EQ(largest, closest[samples[s]]) << "sample " << s;
+                }
+                taken[samples[s]] = true;
+                for (size_t i = 0; i < entries.size(); i++) {
+                    closest[i] = std::min(closest[i],
+                                          metric.distance(entries[i], entries[samples[s]]));
+                }
+            }
+        }
+    });
+}
+
+TYPED_TEST(FarthestTest, SamplingMatchesBruteForce) {
+    typedef typename traits<TypeParam>::point_type Point;
+    expect_sampling<TypeParam>(random_points<Point>(300, 1000, false, 113), 40);
+    expect_sampling<TypeParam>(clustered_points<Point>(300, 114), 40);
+}
+
+// Duplicates come last, at distance 0, and asking for more samples than
+// entries gives every entry once.
+TYPED_TEST(FarthestTest, SamplingEveryEntry) {
+    typedef typename traits<TypeParam>::point_type Point;
+    expect_sampling<TypeParam>(random_points<Point>(60, 4, true, 115), 100);
+}
+
+TYPED_TEST(FarthestTest, Empty) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    tree.build();
+
+    typename Tree::query_result farthest;
+    std::vector<typename Tree::query_result> results;
+    std::vector<size_t> samples;
+    EXPECT_FALSE(tree.farthest(Point(), farthest));
+    tree.kfarthest(Point(), 3, results);
+    EXPECT_TRUE(results.empty());
+    tree.farthest_point_sampling(3, samples);
+    EXPECT_TRUE(samples.empty());
+}
+
+} // namespace
@@ -0,0 +1,110 @@
+#include "test_util.h"
+
+#include <kdforest.h>
+
+namespace {
+
+using namespace test_util;
+
+template <typename Point>
+class ForestTest : public ::testing::Test {};
+
+typedef ::testing::Types<point2, point3> point_types;
+
+TYPED_TEST_SUITE(ForestTest, point_types);
+
+// Fraction of the true k nearest distances the forest found.
+template <typename Result>
+double recall(const std::vector<double> &expected, size_t k,
+              const std::vector<Result> &found) {
+    size_t hits = 0;
+    for (size_t j = 0; j < found.size(); j++) {
+        if (found[j].comparable_distance <= expected[k - 1]) {
+            hits++;
+        }
+    }
+    return double(hits) / k;
+}
+
+// checks == 0 searches until the answer is exact.
+TYPED_TEST(ForestTest, ExactWithoutALimit) {
+    typedef TypeParam Point;
+    const euclidean_metric metric;
+    const std::vector<Point> entries = random_points<Point>(1000, 100, true, 41);
+    const std::vector<Point> queries = random_points<Point>(50, 100, false, 42);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    for (size_t trees = 1; trees <= 4; trees += 3) {
+        kdforest<int, Point> forest(trees);
+        for (size_t i = 0; i < entries.size(); i++) {
+            forest.add(&entries[i], &data[i]);
+        }
+        forest.build();
+
+        typename kdforest<int, Point>::query_context context;
+        std::vector<typename kdforest<int, Point>::query_result> results;
+        for (size_t q = 0; q < queries.size(); q++) {
+            forest.knearest(queries[q], 6, 0, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 6, results);
+        }
+    }
+}
+
+// A limited search still returns real entries at their true distances,
+// sorted, and finds most of the true neighbors.
+TYPED_TEST(ForestTest, RecallWithALimit) {
+    typedef TypeParam Point;
+    const euclidean_metric metric;
+    const std::vector<Point> entries = clustered_points<Point>(5000, 43);
+    const std::vector<Point> queries = clustered_points<Point>(200, 44);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+    const size_t k = 10;
+
+    kdforest<int, Point> forest(4);
+    for (size_t i = 0; i < entries.size(); i++) {
+        forest.add(&entries[i], &data[i]);
+    }
+    forest.build();
+
+    typename kdforest<int, Point>::query_context context;
+    std::vector<typename kdforest<int, Point>::query_result> results;
+    double previous = 0;
+    for (size_t checks = 50; checks <= 800; checks *= 4) {
+        SCOPED_TRACE(checks);
+        double total = 0;
+        for (size_t q = 0; q < queries.size(); q++) {
+            forest.knearest(queries[q], k, checks, results, context);
+            ASSERT_EQ(k, results.size());
+            for (size_t j = 0; j < k; j++) {
+                EXPECT_EQ(&entries[*results[j].data], results[j].point);
+                EXPECT_EQ(metric.distance(queries[q], *results[j].point),
+                          results[j].comparable_distance);
+                EXPECT_LE(expected[q][j], results[j].comparable_distance);
+                if (j > 0) {
+                    EXPECT_LE(results[j - 1].comparable_distance, results[j].comparable_distance);
+                }
+            }
+            total += recall(expected[q], k, results);
+        }
+        // More checks never find less.
+        EXPECT_GE(total / queries.size(), previous);
+        previous = total / queries.size();
+    }
+    EXPECT_GE(previous, 0.95);
+
+    typename kdforest<int, Point>::query_result nearest;
+    ASSERT_TRUE(forest.nearest(queries[0], 0, nearest));
+    EXPECT_EQ(expected[0][0], nearest.comparable_distance);
+}
+
+TYPED_TEST(ForestTest, Empty) {
+    kdforest<int, TypeParam> forest;
+    forest.build();
+    std::vector<typename kdforest<int, TypeParam>::query_result> results;
+    forest.knearest(TypeParam(), 3, 0, results);
+    EXPECT_TRUE(results.empty());
+}
+
+} // namespace
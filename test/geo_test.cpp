@@ -0,0 +1,130 @@
+#include "test_util.h"
+
+#include <geo_kdtree.h>
+
+namespace {
+
+using namespace test_util;
+
+typedef boost::geometry::model::point<
+    double, 2, boost::geometry::cs::geographic<boost::geometry::degree> > lonlat;
+
+template <typename Split>
+class GeoTest : public ::testing::Test {};
+
+typedef ::testing::Types<median_split, max_spread_split, sliding_midpoint_split> split_types;
+
+TYPED_TEST_SUITE(GeoTest, split_types);
+
+const double pi = 3.14159265358979323846;
+const double earth = 6371008.8;
+
+// Great circle distance in meters by the haversine formula.
+double haversine(const lonlat &a, const lonlat &b) {
+    const double lon1 = boost::geometry::get_as_radian<0>(a);
+    const double lat1 = boost::geometry::get_as_radian<1>(a);
+    const double lon2 = boost::geometry::get_as_radian<0>(b);
+    const double lat2 = boost::geometry::get_as_radian<1>(b);
+    const double s = std::sin((lat2 - lat1) / 2);
+    const double t = std::sin((lon2 - lon1) / 2);
+    const double h = s * s + std::cos(lat1) * std::cos(lat2) * t * t;
+    return 2 * earth * std::asin(std::min(1.0, std::sqrt(h)));
+}
+
+// Uniform on the sphere, plus a band along the antimeridian and a cap
+// around each pole, where longitudes wrap and bunch up.
+std::vector<lonlat> random_places(size_t n, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::vector<lonlat> places(n);
+    for (size_t i = 0; i < n; i++) {
+        double lon = unit(random) * 360 - 180;
+        double lat = std::asin(unit(random) * 2 - 1) * 180 / pi;
+        switch (i % 4) {
+            case 1: lon = (lon < 0 ? -180 : 180) * (1 - unit(random) / 360); break;
+            case 2: lat = 89.5 + unit(random) * 0.5; break;
+            case 3: lat = -89.5 - unit(random) * 0.5; break;
+        }
+        places[i] = lonlat(lon, lat);
+    }
+    return places;
+}
+
+TYPED_TEST(GeoTest, MatchesHaversine) {
+    typedef geo_kdtree<int, lonlat, TypeParam> Tree;
+    typedef typename kdtree<int, point3, TypeParam>::build_strategy build_strategy;
+
+    const std::vector<lonlat> entries = random_places(2000, 81);
+    const std::vector<lonlat> queries = random_places(100, 82);
+    const std::vector<int> data = identities(entries.size());
+    const size_t k = 5;
+
+    for (int strategy = 0; strategy < 3; strategy++) {
+        SCOPED_TRACE(strategy);
+        Tree tree;
+        for (size_t i = 0; i < entries.size(); i++) {
+            tree.add(&entries[i], &data[i]);
+        }
+        tree.build(static_cast<build_strategy>(strategy));
+
+        typename Tree::query_context context;
+        std::vector<typename Tree::query_result> results;
+        typename Tree::query_result nearest;
+        for (size_t q = 0; q < queries.size(); q++) {
+            std::vector<double> expected(entries.size());
+            for (size_t i = 0; i < entries.size(); i++) {
+                expected[i] = haversine(queries[q], entries[i]);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            tree.knearest(queries[q], k, results, context);
+            ASSERT_EQ(k, results.size());
+            for (size_t j = 0; j < k; j++) {
+                EXPECT_EQ(&entries[*results[j].data], results[j].point);
+                // A meter is well above the rounding of either formula.
+                EXPECT_NEAR(expected[j], results[j].distance(), 1.0) << "query " << q;
+                EXPECT_NEAR(haversine(queries[q], *results[j].point), results[j].distance(), 1.0);
+            }
+
+            ASSERT_TRUE(tree.nearest(queries[q], nearest, context));
+            EXPECT_NEAR(expected[0], nearest.distance(), 1.0);
+        }
+    }
+}
+
+// Radians in, the same places out.
+TEST(GeoRadiansTest, MatchesDegrees) {
+    typedef boost::geometry::model::point<
+        double, 2, boost::geometry::cs::geographic<boost::geometry::radian> > radians;
+
+    const std::vector<lonlat> entries = random_places(500, 83);
+    const std::vector<lonlat> queries = random_places(50, 84);
+    std::vector<radians> converted(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        converted[i] = radians(boost::geometry::get_as_radian<0>(entries[i]),
+                               boost::geometry::get_as_radian<1>(entries[i]));
+    }
+    const std::vector<int> data = identities(entries.size());
+
+    geo_kdtree<int> degree_tree;
+    geo_kdtree<int, radians> radian_tree(1.0);
+    for (size_t i = 0; i < entries.size(); i++) {
+        degree_tree.add(&entries[i], &data[i]);
+        radian_tree.add(&converted[i], &data[i]);
+    }
+    degree_tree.build();
+    radian_tree.build();
+
+    geo_kdtree<int>::query_result a;
+    geo_kdtree<int, radians>::query_result b;
+    for (size_t q = 0; q < queries.size(); q++) {
+        const radians query(boost::geometry::get_as_radian<0>(queries[q]),
+                            boost::geometry::get_as_radian<1>(queries[q]));
+        ASSERT_TRUE(degree_tree.nearest(queries[q], a));
+        ASSERT_TRUE(radian_tree.nearest(query, b));
+        EXPECT_EQ(a.comparable_distance, b.comparable_distance);
+        EXPECT_NEAR(a.distance() / earth, b.distance(), 1e-12);
+    }
+}
+
+} // namespace
@@ -0,0 +1,144 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class JoinTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(JoinTest, tree_types);
+
+// The query side, a plain tree of another type, with and without boxes.
+template <typename Point>
+struct query_tree {
+    typedef kdtree<int, Point, max_spread_split> type;
+};
+
+template <typename Tree, typename Check>
+void for_each_join(const std::vector<typename traits<Tree>::point_type> &entries,
+                   const std::vector<typename traits<Tree>::point_type> &queries,
+                   Check check) {
+    typedef typename query_tree<typename traits<Tree>::point_type>::type Queries;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<int> ids = identities(queries.size());
+
+    for (int boxes = 0; boxes < 2; boxes++) {
+        SCOPED_TRACE(boxes ? "query boxes" : "no query boxes");
+        Queries other;
+        other.set_bounding_boxes(boxes != 0);
+        for (size_t i = 0; i < queries.size(); i++) {
+            other.add(&queries[i], &ids[i]);
+        }
+        other.build();
+
+        for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+            check(tree, other);
+        });
+    }
+}
+
+TYPED_TEST(JoinTest, NearestJoinMatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = clustered_points<Point>(400, 61);
+    const std::vector<Point> queries = random_points<Point>(150, 1000, false, 62);
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    typedef typename query_tree<Point>::type Queries;
+    for_each_join<Tree>(entries, queries, [&](const Tree &tree, const Queries &other) {
+        std::vector<typename Tree::query_result> results;
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            tree.nearest_join(other, results, threads);
+            ASSERT_EQ(queries.size(), results.size());
+            for (size_t q = 0; q < queries.size(); q++) {
+                expect_knearest(metric, entries, queries[q], expected[q], 1, &results[q], 1);
+            }
+        }
+    });
+}
+
+// Entries exactly radius away are in.
+TYPED_TEST(JoinTest, WithinJoinMatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    typedef typename traits<Tree>::metric_type Metric;
+    const Metric metric = make_metric<Metric>();
+    const double radius = 4;
+
+    const std::vector<Point> entries = random_points<Point>(300, 30, true, 63);
+    const std::vector<Point> queries = random_points<Point>(80, 30, true, 64);
+
+    std::vector<std::vector<int> > expected(queries.size());
+    for (size_t q = 0; q < queries.size(); q++) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (metric.distance(queries[q], entries[i]) <= Metric::to_comparable(radius)) {
+                expected[q].push_back(static_cast<int>(i));
+            }
+        }
+    }
+
+    typedef typename query_tree<Point>::type Queries;
+    for_each_join<Tree>(entries, queries, [&](const Tree &tree, const Queries &other) {
+        std::vector<std::vector<typename Tree::query_result> > results;
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            tree.within_join(other, radius, results, threads);
+            ASSERT_EQ(queries.size(), results.size());
+            for (size_t q = 0; q < queries.size(); q++) {
+                std::vector<int> found;
+                for (size_t j = 0; j < results[q].size(); j++) {
+                    const typename Tree::query_result &r = results[q][j];
+                    EXPECT_EQ(&entries[*r.data], r.point);
+                    EXPECT_EQ(metric.distance(queries[q], *r.point), r.comparable_distance);
+                    if (j > 0) {
+                        EXPECT_LE(results[q][j - 1].comparable_distance, r.comparable_distance);
+                    }
+                    found.push_back(*r.data);
+                }
+                std::sort(found.begin(), found.end());
+                EXPECT_EQ(expected[q], found) << "query " << q;
+            }
+        }
+    });
+}
+
+TYPED_TEST(JoinTest, EmptySides) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    typedef typename query_tree<Point>::type Queries;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> points = random_points<Point>(20, 10, false, 65);
+    const std::vector<int> data = identities(points.size());
+    Tree tree(metric), empty(metric);
+    Queries other, none;
+    for (size_t i = 0; i < points.size(); i++) {
+        tree.add(&points[i], &data[i]);
+        other.add(&points[i], &data[i]);
+    }
+    tree.build();
+    other.build();
+    empty.build();
+    none.build();
+
+    std::vector<typename Tree::query_result> results;
+    tree.nearest_join(none, results);
+    EXPECT_TRUE(results.empty());
+    empty.nearest_join(other, results);
+    ASSERT_EQ(points.size(), results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+        EXPECT_TRUE(results[i].data == NULL);
+    }
+
+    std::vector<std::vector<typename Tree::query_result> > within;
+    empty.within_join(other, 5, within);
+    ASSERT_EQ(points.size(), within.size());
+    for (size_t i = 0; i < within.size(); i++) {
+        EXPECT_TRUE(within[i].empty());
+    }
+}
+
+} // namespace
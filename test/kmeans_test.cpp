@@ -0,0 +1,138 @@
+#include "test_util.h"
+
+#include <kmeans.h>
+
+namespace {
+
+using namespace test_util;
+
+template <typename Assignment>
+class KmeansTest : public ::testing::Test {};
+
+template <typename Assignment> struct assignment_traits;
+
+template <typename Point, typename Metric>
+struct assignment_traits<kmeans_assignment<Point, Metric> > {
+    typedef Point point_type;
+    typedef Metric metric_type;
+};
+
+typedef ::testing::Types<
+    kmeans_assignment<point2>,
+    kmeans_assignment<point3>,
+    kmeans_assignment<point2, manhattan_metric>,
+    kmeans_assignment<point3, chebyshev_metric> > assignment_types;
+
+TYPED_TEST_SUITE(KmeansTest, assignment_types);
+
+// Every point with one of its nearest centroids, the sums and counts of
+// exactly those points, and the error the sum of the nearest distances.
+template <typename Assignment>
+void expect_assignment(const std::vector<typename assignment_traits<Assignment>::point_type> &points,
+                       const std::vector<typename assignment_traits<Assignment>::point_type> &centroids) {
+    typedef typename assignment_traits<Assignment>::point_type Point;
+    typedef typename assignment_traits<Assignment>::metric_type Metric;
+    const std::size_t dimension = boost::geometry::dimension<Point>::value;
+    const Metric metric;
+
+    std::vector<double> nearest(points.size(), std::numeric_limits<double>::infinity());
+    double expected_error = 0;
+    for (size_t i = 0; i < points.size(); i++) {
+        for (size_t c = 0; c < centroids.size(); c++) {
+            nearest[i] = std::min(nearest[i], metric.distance(points[i], centroids[c]));
+        }
+        expected_error += nearest[i];
+    }
+
+    Assignment assignment;
+    assignment.set_centroids(centroids);
+    for (unsigned threads = 1; threads <= 4; threads += 3) {
+        std::vector<size_t> labels;
+        std::vector<Point> sums;
+        std::vector<size_t> counts;
+        const double error = assignment.assign(points, labels, sums, counts, threads);
+
+        ASSERT_EQ(points.size(), labels.size());
+        ASSERT_EQ(centroids.size(), sums.size());
+        ASSERT_EQ(centroids.size(), counts.size());
+
+        std::vector<std::vector<double> > expected_sums(centroids.size(),
+                                                        std::vector<double>(dimension, 0.0));
+        std::vector<size_t> expected_counts(centroids.size(), 0);
+        for (size_t i = 0; i < points.size(); i++) {
+            ASSERT_LT(labels[i], centroids.size());
+            EXPECT_EQ(nearest[i], metric.distance(points[i], centroids[labels[i]]))
+                << "point " << i;
+            expected_counts[labels[i]]++;
+            for (std::size_t a = 0; a < dimension; a++) {
+                expected_sums[labels[i]][a] += util::get(points[i], a);
+            }
+        }
+        EXPECT_EQ(expected_counts, counts);
+        for (size_t c = 0; c < centroids.size(); c++) {
+            for (std::size_t a = 0; a < dimension; a++) {
+                EXPECT_NEAR(expected_sums[c][a], util::get(sums[c], a),
+                            1e-9 * (1 + std::fabs(expected_sums[c][a])));
+            }
+        }
+        EXPECT_NEAR(expected_error, error, 1e-9 * (1 + expected_error));
+    }
+}
+
+TYPED_TEST(KmeansTest, AssignMatchesBruteForce) {
+    typedef typename assignment_traits<TypeParam>::point_type Point;
+    const std::vector<Point> points = clustered_points<Point>(3000, 171);
+    expect_assignment<TypeParam>(points, random_points<Point>(1, 1000, false, 172));
+    expect_assignment<TypeParam>(points, random_points<Point>(8, 1000, false, 173));
+    expect_assignment<TypeParam>(points, random_points<Point>(100, 1000, false, 174));
+}
+
+// Duplicate centroids and points on the grid between them, all ties.
+TYPED_TEST(KmeansTest, Ties) {
+    typedef typename assignment_traits<TypeParam>::point_type Point;
+    std::vector<Point> centroids = random_points<Point>(20, 10, true, 175);
+    centroids.insert(centroids.end(), centroids.begin(), centroids.begin() + 10);
+    expect_assignment<TypeParam>(random_points<Point>(500, 10, true, 176), centroids);
+}
+
+// Lloyd's iterations never increase the squared error.
+TEST(KmeansLloydTest, ErrorDecreases) {
+    const std::vector<point2> points = clustered_points<point2>(2000, 177);
+    std::vector<point2> centroids = random_points<point2>(8, 1000, false, 178);
+
+    kmeans_assignment<point2> assignment;
+    std::vector<size_t> labels;
+    std::vector<point2> sums;
+    std::vector<size_t> counts;
+    double previous = std::numeric_limits<double>::infinity();
+    for (int iteration = 0; iteration < 10; iteration++) {
+        assignment.set_centroids(centroids);
+        const double error = assignment.assign(points, labels, sums, counts, 2);
+        EXPECT_LE(error, previous * (1 + 1e-12)) << "iteration " << iteration;
+        previous = error;
+        for (size_t c = 0; c < centroids.size(); c++) {
+            if (counts[c] > 0) {
+                centroids[c] = point2(sums[c].x() / counts[c], sums[c].y() / counts[c]);
+            }
+        }
+    }
+}
+
+TEST(KmeansEmptyTest, NothingToAssign) {
+    kmeans_assignment<point2> assignment;
+    std::vector<size_t> labels;
+    std::vector<point2> sums;
+    std::vector<size_t> counts;
+
+    assignment.set_centroids(std::vector<point2>());
+    EXPECT_EQ(0, assignment.assign(std::vector<point2>(3), labels, sums, counts));
+    EXPECT_EQ(std::vector<size_t>(3, 0), labels);
+    EXPECT_TRUE(sums.empty());
+
+    assignment.set_centroids(std::vector<point2>(2));
+    EXPECT_EQ(0, assignment.assign(std::vector<point2>(), labels, sums, counts));
+    EXPECT_TRUE(labels.empty());
+    EXPECT_EQ(std::vector<size_t>(2, 0), counts);
+}
+
+} // namespace
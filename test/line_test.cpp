@@ -0,0 +1,119 @@
+#include "test_util.h"
+
+#include <boost/geometry/geometries/linestring.hpp>
+#include <boost/geometry/geometries/segment.hpp>
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class LineTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(LineTest, planar_types);
+
+// Sorted Euclidean distances from the line to all the entries.
+template <typename Line, typename Point>
+std::vector<double> line_distances(const Line &line, const std::vector<Point> &entries) {
+    std::vector<double> distances(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        distances[i] = boost::geometry::distance(entries[i], line);
+    }
+    std::sort(distances.begin(), distances.end());
+    return distances;
+}
+
+// The k nearest to the line, at the Euclidean distances of brute force to
+// a rounding, whatever the Metric of the tree.
+template <typename Line, typename Point, typename Result>
+void expect_nearest_to(const Line &line, const std::vector<Point> &entries,
+                       const std::vector<double> &expected, size_t k,
+                       const std::vector<Result> &found) {
+    const double tolerance = 1e-9;
+    ASSERT_EQ(std::min(k, expected.size()), found.size());
+    for (size_t j = 0; j < found.size(); j++) {
+        EXPECT_EQ(&entries[*found[j].data], found[j].point);
+        EXPECT_NEAR(expected[j], found[j].distance(), tolerance) << "neighbor " << j;
+        EXPECT_NEAR(boost::geometry::distance(*found[j].point, line), found[j].distance(),
+                    tolerance);
+        if (j > 0) {
+            EXPECT_LE(found[j - 1].comparable_distance, found[j].comparable_distance);
+        }
+    }
+}
+
+TYPED_TEST(LineTest, SegmentsMatchBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    typedef boost::geometry::model::segment<Point> segment;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(400, 20, false, 131);
+    const std::vector<int> data = identities(entries.size());
+
+    std::vector<segment> segments;
+    segments.push_back(segment(Point(1, 1), Point(19, 17)));
+    segments.push_back(segment(Point(5, 10), Point(15, 10)));   // along an axis
+    segments.push_back(segment(Point(-8, 3), Point(-2, 30)));   // outside
+    segments.push_back(segment(Point(7, 7), Point(7, 7)));      // a point
+    std::vector<std::vector<double> > expected;
+    for (size_t s = 0; s < segments.size(); s++) {
+        expected.push_back(line_distances(segments[s], entries));
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        typename Tree::query_context context;
+        std::vector<typename Tree::query_result> results;
+        for (size_t s = 0; s < segments.size(); s++) {
+            SCOPED_TRACE(s);
+            tree.knearest_to_segment(segments[s], 6, results, context);
+            expect_nearest_to(segments[s], entries, expected[s], 6, results);
+        }
+        tree.knearest_to_segment(segments[0], entries.size() + 3, results);
+        expect_nearest_to(segments[0], entries, expected[0], entries.size() + 3, results);
+    });
+}
+
+TYPED_TEST(LineTest, PolylinesMatchBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    typedef boost::geometry::model::linestring<Point> linestring;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = clustered_points<Point>(400, 132);
+    const std::vector<int> data = identities(entries.size());
+
+    // A zigzag across the clusters, and one that doubles back on itself.
+    linestring zigzag, back;
+    for (int i = 0; i <= 10; i++) {
+        zigzag.push_back(Point(i * 100, i % 2 ? 900 : 100));
+    }
+    back.push_back(Point(200, 200));
+    back.push_back(Point(800, 500));
+    back.push_back(Point(300, 250));
+    const std::vector<double> expected_zigzag = line_distances(zigzag, entries);
+    const std::vector<double> expected_back = line_distances(back, entries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        typename Tree::query_context context;
+        std::vector<typename Tree::query_result> results;
+        tree.knearest_to_polyline(zigzag, 10, results, context);
+        expect_nearest_to(zigzag, entries, expected_zigzag, 10, results);
+        tree.knearest_to_polyline(back, 10, results);
+        expect_nearest_to(back, entries, expected_back, 10, results);
+    });
+}
+
+TYPED_TEST(LineTest, Empty) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    tree.build();
+    std::vector<typename Tree::query_result> results;
+    tree.knearest_to_segment(boost::geometry::model::segment<Point>(Point(), Point()), 3, results);
+    EXPECT_TRUE(results.empty());
+    tree.knearest_to_polyline(boost::geometry::model::linestring<Point>(), 3, results);
+    EXPECT_TRUE(results.empty());
+}
+
+} // namespace
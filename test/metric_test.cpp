@@ -0,0 +1,86 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+TEST(MetricValuesTest, KnownDistances) {
+    const point2 a(1, 2), b(4, -2);
+    std::vector<double> weights;
+    weights.push_back(2);
+    weights.push_back(0.5);
+
+    EXPECT_EQ(25, euclidean_metric().distance(a, b));
+    EXPECT_EQ(7, manhattan_metric().distance(a, b));
+    EXPECT_EQ(4, chebyshev_metric().distance(a, b));
+    EXPECT_EQ(2 * 9 + 0.5 * 16, weighted_euclidean_metric(weights).distance(a, b));
+
+    EXPECT_EQ(5, euclidean_metric::to_distance(25));
+    EXPECT_EQ(25, euclidean_metric::to_comparable(5));
+    EXPECT_EQ(7, manhattan_metric::to_distance(manhattan_metric::to_comparable(7)));
+    EXPECT_EQ(4, chebyshev_metric::to_distance(chebyshev_metric::to_comparable(4)));
+    EXPECT_EQ(3, weighted_euclidean_metric::to_distance(9));
+}
+
+// Split policies and metrics the point query tests do not pair up.
+template <typename Tree>
+class MetricTest : public ::testing::Test {};
+
+typedef ::testing::Types<
+    kdtree<int, point2, max_spread_split, manhattan_metric>,
+    kdtree<int, point2, surface_area_split, chebyshev_metric>,
+    kdtree<int, point2, sliding_midpoint_split, weighted_euclidean_metric>,
+    kdtree<int, point3, max_spread_split, chebyshev_metric>,
+    kdtree<int, point3, surface_area_split, weighted_euclidean_metric> > metric_types;
+
+TYPED_TEST_SUITE(MetricTest, metric_types);
+
+template <typename Tree>
+void expect_queries(const typename traits<Tree>::metric_type &metric,
+                    const std::vector<typename traits<Tree>::point_type> &entries,
+                    const std::vector<typename traits<Tree>::point_type> &queries) {
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        typename Tree::query_context context;
+        typename Tree::query_result nearest;
+        std::vector<typename Tree::query_result> results;
+        for (size_t q = 0; q < queries.size(); q++) {
+            ASSERT_TRUE(tree.nearest_recursive(queries[q], nearest, context));
+            expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+            ASSERT_TRUE(tree.nearest_iterative(queries[q], nearest, context));
+            expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+            tree.knearest(queries[q], 5, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 5, results);
+            tree.knearest_iterative(queries[q], 5, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 5, results);
+        }
+    });
+}
+
+TYPED_TEST(MetricTest, QueriesMatchBruteForce) {
+    typedef typename traits<TypeParam>::point_type Point;
+    typedef typename traits<TypeParam>::metric_type Metric;
+    for (int integral = 0; integral < 2; integral++) {
+        expect_queries<TypeParam>(make_metric<Metric>(),
+                                  random_points<Point>(300, 30, integral != 0, 91),
+                                  random_points<Point>(40, 30, false, 92));
+    }
+}
+
+// A zero weight ignores its axis altogether, a large one makes it count
+// for nearly everything.
+TEST(WeightedMetricTest, ExtremeWeights) {
+    typedef kdtree<int, point2, median_split, weighted_euclidean_metric> Tree;
+    const std::vector<point2> entries = random_points<point2>(300, 30, true, 93);
+    const std::vector<point2> queries = random_points<point2>(40, 30, false, 94);
+
+    std::vector<double> weights(2, 0);
+    weights[0] = 1;
+    expect_queries<Tree>(weighted_euclidean_metric(weights), entries, queries);
+    weights[1] = 1e6;
+    expect_queries<Tree>(weighted_euclidean_metric(weights), entries, queries);
+}
+
+} // namespace
@@ -0,0 +1,148 @@
+#include "test_util.h"
+
+#include <utility>
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class PairsTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(PairsTest, tree_types);
+
+typedef std::vector<std::pair<size_t, size_t> > pair_list;
+
+// Every pair at most eps apart, first < second, sorted.
+template <typename Metric, typename Point>
+pair_list pairs_within(const Metric &metric, const std::vector<Point> &entries, double eps) {
+    pair_list pairs;
+    for (size_t i = 0; i < entries.size(); i++) {
+        for (size_t j = i + 1; j < entries.size(); j++) {
+            if (metric.distance(entries[i], entries[j]) <= Metric::to_comparable(eps)) {
+                pairs.push_back(std::make_pair(i, j));
+            }
+        }
+    }
+    return pairs;
+}
+
+// Smallest entry of every group of linked pairs.
+inline std::vector<size_t> smallest_linked(size_t n, const pair_list &pairs) {
+    std::vector<size_t> representatives(n);
+    for (size_t i = 0; i < n; i++) {
+        representatives[i] = i;
+    }
+    // Relax until nothing changes, slow but plainly right.
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (size_t p = 0; p < pairs.size(); p++) {
+            size_t &a = representatives[pairs[p].first];
+            size_t &b = representatives[pairs[p].second];
+            if (a != b) {
+                a = b = std::min(a, b);
+                changed = true;
+            }
+        }
+    }
+    return representatives;
+}
+
+// Integral coordinates, so plenty of pairs lie exactly eps apart.
+TYPED_TEST(PairsTest, FindPairsWithinMatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(300, 40, true, 71);
+    const std::vector<int> data = identities(entries.size());
+    const double radii[] = { 0, 1, 3 };
+    std::vector<pair_list> expected;
+    for (size_t r = 0; r < 3; r++) {
+        expected.push_back(pairs_within(metric, entries, radii[r]));
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        pair_list pairs;
+        for (size_t r = 0; r < 3; r++) {
+            for (unsigned threads = 1; threads <= 4; threads += 3) {
+                tree.find_pairs_within(radii[r], pairs, threads);
+                EXPECT_EQ(expected[r], pairs) << "eps " << radii[r];
+            }
+        }
+    });
+}
+
+TYPED_TEST(PairsTest, MergeWithinMatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = clustered_points<Point>(300, 72);
+    const std::vector<int> data = identities(entries.size());
+    const double eps = 1.5;
+    const std::vector<size_t> expected =
+        smallest_linked(entries.size(), pairs_within(metric, entries, eps));
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        std::vector<size_t> representatives;
+        for (unsigned threads = 1; threads <= 4; threads += 3) {
+            tree.merge_within(eps, representatives, threads);
+            EXPECT_EQ(expected, representatives);
+        }
+    });
+}
+
+TYPED_TEST(PairsTest, ClosestPairMatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(400, 1000, false, 73);
+    const std::vector<int> data = identities(entries.size());
+    double closest = std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < entries.size(); i++) {
+        for (size_t j = i + 1; j < entries.size(); j++) {
+            closest = std::min(closest, metric.distance(entries[i], entries[j]));
+        }
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        typename Tree::query_result first, second;
+        ASSERT_TRUE(tree.closest_pair(first, second, 2));
+        ASSERT_TRUE(first.data != NULL && second.data != NULL);
+        EXPECT_NE(*first.data, *second.data);
+        EXPECT_EQ(&entries[*first.data], first.point);
+        EXPECT_EQ(&entries[*second.data], second.point);
+        EXPECT_EQ(closest, second.comparable_distance);
+        EXPECT_EQ(closest, metric.distance(*first.point, *second.point));
+    });
+}
+
+TYPED_TEST(PairsTest, FewEntries) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    const std::vector<Point> entries = random_points<Point>(1, 10, false, 74);
+    const std::vector<int> data = identities(entries.size());
+
+    Tree tree(metric);
+    typename Tree::query_result first, second;
+    pair_list pairs;
+    std::vector<size_t> representatives;
+
+    tree.build();
+    EXPECT_FALSE(tree.closest_pair(first, second));
+    tree.find_pairs_within(100, pairs);
+    EXPECT_TRUE(pairs.empty());
+    tree.merge_within(100, representatives);
+    EXPECT_TRUE(representatives.empty());
+
+    tree.add(&entries[0], &data[0]);
+    tree.build();
+    EXPECT_FALSE(tree.closest_pair(first, second));
+    tree.merge_within(100, representatives);
+    EXPECT_EQ(std::vector<size_t>(1, 0), representatives);
+}
+
+} // namespace
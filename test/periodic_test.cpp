@@ -0,0 +1,144 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class PeriodicTest : public ::testing::Test {};
+
+typedef ::testing::Types<
+    kdtree<int, point2, median_split, periodic_metric>,
+    kdtree<int, point2, max_spread_split, periodic_metric>,
+    kdtree<int, point2, sliding_midpoint_split, periodic_metric>,
+    kdtree<int, point2, surface_area_split, periodic_metric>,
+    kdtree<int, point3, median_split, periodic_metric>,
+    kdtree<int, point3, sliding_midpoint_split, periodic_metric> > periodic_types;
+
+TYPED_TEST_SUITE(PeriodicTest, periodic_types);
+
+// A box of 100 by 40 (by 10), not starting at the origin.
+template <typename Point>
+periodic_metric domain() {
+    const double lower[] = { -50, 10, 0 };
+    const double upper[] = { 50, 50, 10 };
+    const std::size_t dimension = boost::geometry::dimension<Point>::value;
+    return periodic_metric(std::vector<double>(lower, lower + dimension),
+                           std::vector<double>(upper, upper + dimension));
+}
+
+// Uniform in the domain, with every other point pushed against a wall.
+template <typename Point>
+std::vector<Point> random_inside(const periodic_metric &metric, size_t n, unsigned seed) {
+    std::vector<Point> points = random_points<Point>(n, 1, false, seed);
+    for (size_t i = 0; i < n; i++) {
+        for (std::size_t a = 0; a < boost::geometry::dimension<Point>::value; a++) {
+            double u = util::get(points[i], a);
+            if (i % 2) {
+                u = u < 0.5 ? u * 0.02 : 1 - (1 - u) * 0.02;
+            }
+            util::set(points[i], a, metric.lower[a] + u * (metric.upper[a] - metric.lower[a]));
+        }
+    }
+    return points;
+}
+
+// Squared distance to the closest of the 3^d images of b, the ghost copies
+// the periodic metric saves.
+template <typename Point>
+double ghost_distance(const periodic_metric &metric, const Point &a, const Point &b) {
+    const std::size_t dimension = boost::geometry::dimension<Point>::value;
+    double best = std::numeric_limits<double>::infinity();
+    size_t images = 1;
+    for (std::size_t i = 0; i < dimension; i++) {
+        images *= 3;
+    }
+    for (size_t image = 0; image < images; image++) {
+        double sum = 0;
+        size_t shift = image;
+        for (std::size_t i = 0; i < dimension; i++, shift /= 3) {
+            const double period = metric.upper[i] - metric.lower[i];
+            const double d = util::get(a, i) - util::get(b, i) - (double(shift % 3) - 1) * period;
+            sum += d * d;
+        }
+        best = std::min(best, sum);
+    }
+    return best;
+}
+
+TYPED_TEST(PeriodicTest, MatchesGhostCopies) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const periodic_metric metric = domain<Point>();
+
+    const std::vector<Point> entries = random_inside<Point>(metric, 300, 101);
+    const std::vector<Point> queries = random_inside<Point>(metric, 60, 102);
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    // The metric itself against the images, to a rounding.
+    for (size_t q = 0; q < queries.size(); q++) {
+        std::vector<double> ghosts(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            ghosts[i] = ghost_distance(metric, queries[q], entries[i]);
+        }
+        std::sort(ghosts.begin(), ghosts.end());
+        for (size_t i = 0; i < ghosts.size(); i++) {
+            ASSERT_NEAR(ghosts[i], expected[q][i], 1e-9 * (1 + ghosts[i]));
+        }
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        typename Tree::query_context context;
+        typename Tree::query_result nearest;
+        std::vector<typename Tree::query_result> results;
+        for (size_t q = 0; q < queries.size(); q++) {
+            ASSERT_TRUE(tree.nearest_recursive(queries[q], nearest, context));
+            expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+            ASSERT_TRUE(tree.nearest_iterative(queries[q], nearest, context));
+            expect_knearest(metric, entries, queries[q], expected[q], 1, &nearest, 1);
+            tree.knearest(queries[q], 8, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 8, results);
+            tree.knearest_iterative(queries[q], 8, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 8, results);
+        }
+    });
+}
+
+// Self joins and batches wrap around as well.
+TYPED_TEST(PeriodicTest, JoinsWrapAround) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const periodic_metric metric = domain<Point>();
+
+    const std::vector<Point> entries = random_inside<Point>(metric, 200, 103);
+    const std::vector<int> data = identities(entries.size());
+    const double eps = 3;
+
+    std::vector<std::pair<size_t, size_t> > expected;
+    for (size_t i = 0; i < entries.size(); i++) {
+        for (size_t j = i + 1; j < entries.size(); j++) {
+            if (metric.distance(entries[i], entries[j]) <= periodic_metric::to_comparable(eps)) {
+                expected.push_back(std::make_pair(i, j));
+            }
+        }
+    }
+    const std::vector<std::vector<double> > distances = brute_force(metric, entries, entries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        std::vector<std::pair<size_t, size_t> > pairs;
+        tree.find_pairs_within(eps, pairs, 2);
+        EXPECT_EQ(expected, pairs);
+
+        // Each entry is its own nearest, at 0, then the rest.
+        std::vector<typename Tree::query_result> neighbors;
+        tree.knearest_all(3, neighbors, 2);
+        for (size_t i = 0; i < entries.size(); i++) {
+            for (size_t j = 0; j < 3; j++) {
+                EXPECT_EQ(distances[i][j + 1], neighbors[i * 3 + j].comparable_distance);
+            }
+        }
+    });
+}
+
+} // namespace
@@ -0,0 +1,106 @@
+#include "test_util.h"
+
+#include <boost/geometry/geometries/ring.hpp>
+#include <boost/geometry/geometries/multi_polygon.hpp>
+#include <boost/geometry/geometries/polygon.hpp>
+
+namespace {
+
+using namespace test_util;
+
+typedef boost::geometry::model::polygon<point2> polygon;
+typedef boost::geometry::model::multi_polygon<polygon> multi_polygon;
+typedef boost::geometry::model::ring<point2> ring;
+
+template <typename Tree>
+class PolygonTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(PolygonTest, planar_types);
+
+template <typename Geometry>
+Geometry read(const char *wkt) {
+    Geometry geometry;
+    boost::geometry::read_wkt(wkt, geometry);
+    boost::geometry::correct(geometry);
+    return geometry;
+}
+
+// Entries covered by the geometry, boundary included, in order.
+template <typename Geometry>
+std::vector<int> covered(const std::vector<point2> &entries, const Geometry &geometry) {
+    std::vector<int> inside;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (boost::geometry::covered_by(entries[i], geometry)) {
+            inside.push_back(static_cast<int>(i));
+        }
+    }
+    return inside;
+}
+
+template <typename Tree, typename Geometry>
+void expect_within(const Tree &tree, const std::vector<point2> &entries,
+                   const Geometry &geometry, const std::vector<int> &expected) {
+    std::vector<typename Tree::query_result> results;
+    tree.query_within(geometry, results);
+    std::vector<int> found;
+    for (size_t i = 0; i < results.size(); i++) {
+        EXPECT_EQ(&entries[*results[i].data], results[i].point);
+        EXPECT_EQ(0, results[i].comparable_distance);
+        found.push_back(*results[i].data);
+    }
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(expected, found);
+}
+
+// Integral coordinates and vertices, so plenty of entries lie on edges and
+// corners.
+TYPED_TEST(PolygonTest, MatchesBruteForce) {
+    typedef TypeParam Tree;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<point2> entries = random_points<point2>(1500, 40, true, 121);
+    const std::vector<int> data = identities(entries.size());
+
+    std::vector<polygon> polygons;
+    // Concave.
+    polygons.push_back(read<polygon>("POLYGON((2 2,30 2,30 10,10 10,10 30,2 30,2 2))"));
+    // A star, with slanted edges.
+    polygons.push_back(read<polygon>(
+        "POLYGON((20 2,24 14,37 14,26 22,30 35,20 27,10 35,14 22,3 14,16 14,20 2))"));
+    // A hole.
+    polygons.push_back(read<polygon>(
+        "POLYGON((5 5,35 5,35 35,5 35,5 5),(12 12,12 28,28 28,28 12,12 12))"));
+    // Partly outside the entries, and one entirely.
+    polygons.push_back(read<polygon>("POLYGON((-10 -10,15 -10,15 15,-10 15,-10 -10))"));
+    polygons.push_back(read<polygon>("POLYGON((50 50,60 50,60 60,50 50))"));
+    const multi_polygon multi = read<multi_polygon>(
+        "MULTIPOLYGON(((0 0,8 0,8 8,0 0)),((20 20,39 20,39 39,20 39,20 20)))");
+    const ring triangle = read<ring>("POLYGON((7 3,33 21,7 33,7 3))");
+
+    std::vector<std::vector<int> > expected;
+    for (size_t p = 0; p < polygons.size(); p++) {
+        expected.push_back(covered(entries, polygons[p]));
+    }
+    const std::vector<int> expected_multi = covered(entries, multi);
+    const std::vector<int> expected_ring = covered(entries, triangle);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        for (size_t p = 0; p < polygons.size(); p++) {
+            SCOPED_TRACE(p);
+            expect_within(tree, entries, polygons[p], expected[p]);
+        }
+        expect_within(tree, entries, multi, expected_multi);
+        expect_within(tree, entries, triangle, expected_ring);
+    });
+}
+
+TYPED_TEST(PolygonTest, Empty) {
+    typedef TypeParam Tree;
+    Tree tree(make_metric<typename traits<Tree>::metric_type>());
+    tree.build();
+    std::vector<typename Tree::query_result> results;
+    tree.query_within(read<polygon>("POLYGON((0 0,1 0,1 1,0 0))"), results);
+    EXPECT_TRUE(results.empty());
+}
+
+} // namespace
@@ -0,0 +1,141 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class ReverseTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(ReverseTest, tree_types);
+
+// Entries no farther from query than from their k-th nearest other entry,
+// in order, and the sorted distances to them.
+template <typename Metric, typename Point>
+void brute_reverse(const Metric &metric, const std::vector<Point> &entries,
+                   const std::vector<double> &radii, const Point &query,
+                   std::vector<int> &expected, std::vector<double> &distances) {
+    expected.clear();
+    distances.clear();
+    for (size_t i = 0; i < entries.size(); i++) {
+        const double d = metric.distance(query, entries[i]);
+        if (d <= radii[i]) {
+            expected.push_back(static_cast<int>(i));
+            distances.push_back(d);
+        }
+    }
+    std::sort(distances.begin(), distances.end());
+}
+
+// Distance from every entry to its k-th nearest other entry, infinite
+// with fewer than k others.
+template <typename Metric, typename Point>
+std::vector<double> kth_distances(const Metric &metric, const std::vector<Point> &entries,
+                                  size_t k) {
+    std::vector<double> radii(entries.size(), std::numeric_limits<double>::infinity());
+    for (size_t i = 0; i < entries.size(); i++) {
+        std::vector<double> others;
+        for (size_t j = 0; j < entries.size(); j++) {
+            if (j != i) {
+                others.push_back(metric.distance(entries[i], entries[j]));
+            }
+        }
+        std::sort(others.begin(), others.end());
+        if (k > 0 && k <= others.size()) {
+            radii[i] = others[k - 1];
+        }
+    }
+    return radii;
+}
+
+template <typename Tree>
+void expect_reverse(const Tree &tree, const std::vector<typename traits<Tree>::point_type> &entries,
+                    const std::vector<typename traits<Tree>::point_type> &queries,
+                    const std::vector<double> &radii) {
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    std::vector<typename Tree::query_result> results;
+    std::vector<int> expected;
+    std::vector<double> distances;
+    for (size_t q = 0; q < queries.size(); q++) {
+        brute_reverse(metric, entries, radii, queries[q], expected, distances);
+        tree.reverse_knearest(queries[q], results);
+
+        std::vector<int> found;
+        ASSERT_EQ(distances.size(), results.size()) << "query " << q;
+        for (size_t j = 0; j < results.size(); j++) {
+            EXPECT_EQ(&entries[*results[j].data], results[j].point);
+            EXPECT_EQ(distances[j], results[j].comparable_distance);
+            found.push_back(*results[j].data);
+        }
+        std::sort(found.begin(), found.end());
+        EXPECT_EQ(expected, found) << "query " << q;
+    }
+}
+
+// Integral coordinates, so that queries often lie exactly at the k-th
+// distance, which counts.
+TYPED_TEST(ReverseTest, MatchesBruteForce) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(300, 25, true, 181);
+    std::vector<Point> queries = random_points<Point>(40, 25, true, 182);
+    const std::vector<Point> scattered = random_points<Point>(20, 40, false, 183);
+    queries.insert(queries.end(), scattered.begin(), scattered.end());
+    queries.insert(queries.end(), entries.begin(), entries.begin() + 10);
+    const std::vector<int> data = identities(entries.size());
+
+    const size_t ks[] = { 1, 4, 10 };
+    std::vector<std::vector<double> > radii;
+    for (size_t k = 0; k < 3; k++) {
+        radii.push_back(kth_distances(metric, entries, ks[k]));
+    }
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &built) {
+        Tree tree(built);
+        for (size_t k = 0; k < 3; k++) {
+            SCOPED_TRACE(ks[k]);
+            tree.prepare_reverse_knearest(ks[k], 2);
+            EXPECT_EQ(ks[k], tree.reverse_k());
+            expect_reverse(tree, entries, queries, radii[k]);
+        }
+        // Prepared radii survive a relayout.
+        tree.relayout(Tree::breadth_first);
+        expect_reverse(tree, entries, queries, radii[2]);
+    });
+}
+
+// With k beyond the other entries, every entry answers every query.
+TYPED_TEST(ReverseTest, FewEntries) {
+    typedef TypeParam Tree;
+    typedef typename traits<Tree>::point_type Point;
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+
+    const std::vector<Point> entries = random_points<Point>(5, 10, false, 184);
+    const std::vector<Point> queries = random_points<Point>(10, 100, false, 185);
+    const std::vector<int> data = identities(entries.size());
+
+    Tree tree(metric);
+    std::vector<typename Tree::query_result> results;
+    for (size_t i = 0; i < entries.size(); i++) {
+        tree.add(&entries[i], &data[i]);
+    }
+    tree.build();
+    tree.reverse_knearest(queries[0], results);
+    EXPECT_TRUE(results.empty());
+
+    tree.prepare_reverse_knearest(5);
+    expect_reverse(tree, entries, queries, kth_distances(metric, entries, 5));
+    for (size_t q = 0; q < queries.size(); q++) {
+        tree.reverse_knearest(queries[q], results);
+        EXPECT_EQ(entries.size(), results.size());
+    }
+
+    // build() drops the preparation.
+    tree.build();
+    tree.reverse_knearest(queries[0], results);
+    EXPECT_TRUE(results.empty());
+}
+
+} // namespace
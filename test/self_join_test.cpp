@@ -0,0 +1,75 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class SelfJoinTest : public ::testing::Test {};
+
+TYPED_TEST_SUITE(SelfJoinTest, tree_types);
+
+// Sorted distances from entry i to all the others, duplicates of it
+// included.
+template <typename Metric, typename Point>
+std::vector<std::vector<double> > others(const Metric &metric,
+                                         const std::vector<Point> &entries) {
+    std::vector<std::vector<double> > distances(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        for (size_t j = 0; j < entries.size(); j++) {
+            if (j != i) {
+                distances[i].push_back(metric.distance(entries[i], entries[j]));
+            }
+        }
+        std::sort(distances[i].begin(), distances[i].end());
+    }
+    return distances;
+}
+
+template <typename Tree>
+void expect_knearest_all(const std::vector<typename traits<Tree>::point_type> &entries) {
+    const typename traits<Tree>::metric_type metric = make_metric<typename traits<Tree>::metric_type>();
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = others(metric, entries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        std::vector<typename Tree::query_result> neighbors;
+        for (size_t k = 1; k <= 9; k += 4) {
+            for (unsigned threads = 1; threads <= 4; threads += 3) {
+                tree.knearest_all(k, neighbors, threads);
+                ASSERT_EQ(entries.size() * k, neighbors.size());
+                for (size_t i = 0; i < entries.size(); i++) {
+                    const size_t found = std::min(k, expected[i].size());
+                    expect_knearest(metric, entries, entries[i], expected[i], k,
+                                    &neighbors[i * k], found);
+                    for (size_t j = 0; j < found; j++) {
+                        EXPECT_NE(static_cast<int>(i), *neighbors[i * k + j].data);
+                    }
+                    for (size_t j = found; j < k; j++) {
+                        EXPECT_TRUE(neighbors[i * k + j].data == NULL);
+                    }
+                }
+            }
+        }
+    });
+}
+
+TYPED_TEST(SelfJoinTest, KnearestAllMatchesBruteForce) {
+    typedef typename traits<TypeParam>::point_type Point;
+    expect_knearest_all<TypeParam>(random_points<Point>(300, 100, false, 51));
+}
+
+// Plenty of entries at the same position, which are each other's
+// neighbors at distance 0.
+TYPED_TEST(SelfJoinTest, KnearestAllWithDuplicates) {
+    typedef typename traits<TypeParam>::point_type Point;
+    expect_knearest_all<TypeParam>(random_points<Point>(300, 6, true, 52));
+}
+
+// Fewer entries than neighbors asked for pads every row.
+TYPED_TEST(SelfJoinTest, KnearestAllPadsRows) {
+    typedef typename traits<TypeParam>::point_type Point;
+    expect_knearest_all<TypeParam>(random_points<Point>(4, 10, false, 53));
+}
+
+} // namespace
@@ -0,0 +1,73 @@
+#include "test_util.h"
+
+namespace {
+
+using namespace test_util;
+
+template <typename Tree>
+class SplitTest : public ::testing::Test {};
+
+typedef ::testing::Types<
+    kdtree<int, point2>,
+    kdtree<int, point2, max_spread_split>,
+    kdtree<int, point2, sliding_midpoint_split>,
+    kdtree<int, point2, surface_area_split>,
+    kdtree<int, point3, max_spread_split>,
+    kdtree<int, point3, sliding_midpoint_split>,
+    kdtree<int, point3, surface_area_split> > split_types;
+
+TYPED_TEST_SUITE(SplitTest, split_types);
+
+template <typename Tree>
+void expect_answers(const std::vector<typename traits<Tree>::point_type> &entries,
+                    const std::vector<typename traits<Tree>::point_type> &queries) {
+    const typename traits<Tree>::metric_type metric;
+    const std::vector<int> data = identities(entries.size());
+    const std::vector<std::vector<double> > expected = brute_force(metric, entries, queries);
+
+    for_each_build<Tree>(metric, entries, data, [&](const Tree &tree) {
+        EXPECT_EQ(entries.size(), tree.statistics().size);
+        typename Tree::query_context context;
+        std::vector<typename Tree::query_result> results;
+        for (size_t q = 0; q < queries.size(); q++) {
+            tree.knearest(queries[q], 4, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 4, results);
+            tree.knearest_iterative(queries[q], 4, results, context);
+            expect_knearest(metric, entries, queries[q], expected[q], 4, results);
+        }
+    });
+}
+
+// Points along a long thin road, where cycling the axes makes skinny
+// cells.
+TYPED_TEST(SplitTest, AnisotropicData) {
+    typedef typename traits<TypeParam>::point_type Point;
+    std::vector<Point> entries = random_points<Point>(400, 1, false, 21);
+    std::vector<Point> queries = random_points<Point>(40, 1, false, 22);
+    for (size_t i = 0; i < entries.size(); i++) {
+        util::set(entries[i], 0, util::get(entries[i], 0) * 10000);
+    }
+    for (size_t i = 0; i < queries.size(); i++) {
+        util::set(queries[i], 0, util::get(queries[i], 0) * 10000);
+    }
+    expect_answers<TypeParam>(entries, queries);
+}
+
+// Value splits have nothing to split between, they have to fall back.
+TYPED_TEST(SplitTest, AllDuplicates) {
+    typedef typename traits<TypeParam>::point_type Point;
+    const std::vector<Point> entries(200, random_points<Point>(1, 5, false, 23)[0]);
+    expect_answers<TypeParam>(entries, random_points<Point>(10, 5, false, 24));
+}
+
+// Duplicates on one axis only.
+TYPED_TEST(SplitTest, FlatAlongOneAxis) {
+    typedef typename traits<TypeParam>::point_type Point;
+    std::vector<Point> entries = random_points<Point>(300, 50, true, 25);
+    for (size_t i = 0; i < entries.size(); i++) {
+        util::set(entries[i], 1, 7.0);
+    }
+    expect_answers<TypeParam>(entries, random_points<Point>(30, 50, false, 26));
+}
+
+} // namespace
@@ -0,0 +1,202 @@
+#ifndef TEST_UTIL_H_
+#define TEST_UTIL_H_
+
+#include <kdtree.h>
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// Shared by the tests: random inputs, the trees under test built every
+// way they can be, and brute force answers to check them against.
+namespace test_util {
+
+using namespace spatial_index;
+
+typedef boost::geometry::model::d2::point_xy<double> point2;
+typedef boost::geometry::model::point<double, 3, boost::geometry::cs::cartesian> point3;
+
+template <typename Tree> struct traits;
+
+template <typename Data, typename Point, typename Split, typename Metric, typename Aggregate>
+struct traits<kdtree<Data, Point, Split, Metric, Aggregate> > {
+    typedef Point point_type;
+    typedef Metric metric_type;
+};
+
+// Metrics with state get one built here.
+template <typename Metric>
+inline Metric make_metric() { return Metric(); }
+
+template <>
+inline weighted_euclidean_metric make_metric<weighted_euclidean_metric>() {
+    std::vector<double> weights;
+    weights.push_back(1);
+    weights.push_back(4);
+    weights.push_back(0.25);
+    return weighted_euclidean_metric(weights);
+}
+
+// Coordinates in [0, range), whole numbers when integral is set so that
+// there are plenty of duplicates and ties.
+template <typename Point>
+std::vector<Point> random_points(size_t n, double range, bool integral, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> coordinate(0, range);
+    std::vector<Point> points(n);
+    for (size_t i = 0; i < n; i++) {
+        for (std::size_t a = 0; a < boost::geometry::dimension<Point>::value; a++) {
+            double c = coordinate(random);
+            util::set(points[i], a, integral ? std::floor(c) : c);
+        }
+    }
+    return points;
+}
+
+// A few tight Gaussian clusters in [0, 1000).
+template <typename Point>
+std::vector<Point> clustered_points(size_t n, unsigned seed) {
+    std::mt19937 random(seed);
+    std::vector<Point> centers = random_points<Point>(8, 1000, false, seed + 1);
+    std::normal_distribution<double> offset(0, 2);
+    std::vector<Point> points(n);
+    for (size_t i = 0; i < n; i++) {
+        const Point &center = centers[random() % centers.size()];
+        for (std::size_t a = 0; a < boost::geometry::dimension<Point>::value; a++) {
+            util::set(points[i], a, util::get(center, a) + offset(random));
+        }
+    }
+    return points;
+}
+
+// How a tree was built, for the failure messages.
+struct configuration {
+    int strategy;
+    bool boxes;
+    bool relayout;
+
+    std::string describe() const {
+        static const char *strategies[] = { "median_build", "hilbert_build", "presorted_build" };
+        std::ostringstream s;
+        s << strategies[strategy] << (boxes ? ", boxes" : "")
+          << (relayout ? ", van_emde_boas" : "");
+        return s.str();
+    }
+};
+
+// Calls check(tree) on a tree over entries for every build strategy, with
+// and without bounding boxes, and before and after a relayout.
+template <typename Tree, typename Check>
+void for_each_build(const typename traits<Tree>::metric_type &metric,
+                    const std::vector<typename traits<Tree>::point_type> &entries,
+                    const std::vector<int> &data, Check check) {
+    for (int strategy = 0; strategy < 3; strategy++) {
+        for (int boxes = 0; boxes < 2; boxes++) {
+            for (int relayout = 0; relayout < 2; relayout++) {
+                const configuration c = { strategy, boxes != 0, relayout != 0 };
+                SCOPED_TRACE(c.describe());
+
+                Tree tree(metric);
+                tree.set_bounding_boxes(c.boxes);
+                for (size_t i = 0; i < entries.size(); i++) {
+                    tree.add(&entries[i], &data[i]);
+                }
+                tree.build(static_cast<typename Tree::build_strategy>(strategy));
+                if (c.relayout) {
+                    tree.relayout(Tree::van_emde_boas);
+                }
+                check(tree);
+            }
+        }
+    }
+}
+
+// Data of entry i is i.
+inline std::vector<int> identities(size_t n) {
+    std::vector<int> data(n);
+    for (size_t i = 0; i < n; i++) {
+        data[i] = static_cast<int>(i);
+    }
+    return data;
+}
+
+// Comparable distances from query to all the entries, sorted.
+template <typename Metric, typename Point>
+std::vector<double> sorted_distances(const Metric &metric, const std::vector<Point> &entries,
+                                     const Point &query) {
+    std::vector<double> distances(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        distances[i] = metric.distance(query, entries[i]);
+    }
+    std::sort(distances.begin(), distances.end());
+    return distances;
+}
+
+// Sorted distances from every query, computed once per input.
+template <typename Metric, typename Point>
+std::vector<std::vector<double> > brute_force(const Metric &metric,
+                                              const std::vector<Point> &entries,
+                                              const std::vector<Point> &queries) {
+    std::vector<std::vector<double> > distances(queries.size());
+    for (size_t q = 0; q < queries.size(); q++) {
+        distances[q] = sorted_distances(metric, entries, queries[q]);
+    }
+    return distances;
+}
+
+// The k nearest found, against brute force: the same distances in the
+// same order, each the true distance of the entry it comes with. Ties may
+// pick any of the tied entries.
+template <typename Metric, typename Point, typename Result>
+void expect_knearest(const Metric &metric, const std::vector<Point> &entries,
+                     const Point &query, const std::vector<double> &expected,
+                     size_t k, const Result *found, size_t count) {
+    const size_t n = std::min(k, expected.size());
+    ASSERT_EQ(n, count);
+    for (size_t j = 0; j < n; j++) {
+        ASSERT_TRUE(found[j].data != NULL);
+        EXPECT_EQ(expected[j], found[j].comparable_distance) << "neighbor " << j;
+        EXPECT_EQ(metric.distance(query, *found[j].point), found[j].comparable_distance);
+        EXPECT_EQ(&entries[*found[j].data], found[j].point);
+    }
+}
+
+template <typename Metric, typename Point, typename Result>
+void expect_knearest(const Metric &metric, const std::vector<Point> &entries,
+                     const Point &query, const std::vector<double> &expected,
+                     size_t k, const std::vector<Result> &found) {
+    expect_knearest(metric, entries, query, expected, k,
+                    found.empty() ? NULL : &found[0], found.size());
+}
+
+// Every kind of tree the point queries are checked on: the split
+// policies, the metrics and a higher dimension.
+typedef ::testing::Types<
+    kdtree<int, point2>,
+    kdtree<int, point2, max_spread_split>,
+    kdtree<int, point2, sliding_midpoint_split>,
+    kdtree<int, point2, surface_area_split>,
+    kdtree<int, point2, median_split, manhattan_metric>,
+    kdtree<int, point2, median_split, chebyshev_metric>,
+    kdtree<int, point2, median_split, weighted_euclidean_metric>,
+    kdtree<int, point3>,
+    kdtree<int, point3, sliding_midpoint_split, manhattan_metric> > tree_types;
+
+// The planar ones, for the queries boost::geometry only supports in two
+// dimensions.
+typedef ::testing::Types<
+    kdtree<int, point2>,
+    kdtree<int, point2, max_spread_split>,
+    kdtree<int, point2, sliding_midpoint_split>,
+    kdtree<int, point2, surface_area_split>,
+    kdtree<int, point2, median_split, manhattan_metric>,
+    kdtree<int, point2, median_split, chebyshev_metric>,
+    kdtree<int, point2, median_split, weighted_euclidean_metric> > planar_types;
+
+} // namespace test_util
+
+#endif /* TEST_UTIL_H_ */